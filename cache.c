@@ -0,0 +1,868 @@
+/*
+ * libuci - Library for the Unified Configuration Interface
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * This file contains the compiled cache of config files. A cache file
+ * holds the parsed contents of one config file, so that the package can
+ * be built without running the parser:
+ *
+ *   header | sections[] | options[] | values[] | string table
+ *
+ * options are stored in section order, values in option order. strings
+ * are referenced by their offset in the string table. a cache file is
+ * only used if the config file still has the identity (device, inode,
+ * size, mtime) and content hash recorded in its header.
+ *
+ * the ucid daemon publishes the same format as snapshots in UCI_RUNDIR,
+ * which it keeps up to date with the config directory. a new snapshot
+ * replaces the old one atomically, so readers never take a lock: a
+ * mapping stays valid even after its snapshot has been replaced, and the
+ * content hash tells them whether it is still current. a reader that finds
+ * no current snapshot asks the daemon to publish one over its socket.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uci.h"
+#include "uci_internal.h"
+
+#define UCI_CACHE_MAGIC		0x75636963	/* "ucic" */
+#define UCI_CACHE_VERSION	1
+
+#define UCI_CACHE_ANONYMOUS	(1 << 0)
+#define UCI_CACHE_LIST		(1 << 0)
+
+struct uci_cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t hash;
+	uint32_t pad;
+};
+
+struct uci_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	struct uci_cache_key key;
+	uint32_t n_section;
+	uint32_t n_sections;
+	uint32_t n_options;
+	uint32_t n_values;
+	uint32_t strtab_size;
+	uint32_t serial;	/* version of a published snapshot */
+};
+
+struct uci_cache_section {
+	uint32_t type;
+	uint32_t name;
+	uint32_t n_options;
+	uint32_t flags;
+};
+
+struct uci_cache_option {
+	uint32_t name;
+	uint32_t n_values;
+	uint32_t flags;
+};
+
+/* identify the contents of the config file behind a stream */
+static bool uci_cache_key(FILE *stream, struct uci_cache_key *key)
+{
+	int fd = fileno(stream);
+	uint32_t hash = 5381;
+	char buf[4096];
+	struct stat st;
+	off_t ofs = 0;
+	ssize_t len, i;
+
+	if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+		return false;
+
+	/* NB: pread leaves the position of the stream alone */
+	while ((len = pread(fd, buf, sizeof(buf), ofs)) > 0) {
+		for (i = 0; i < len; i++)
+			hash = ((hash << 5) + hash) + (unsigned char) buf[i];
+		ofs += len;
+	}
+	if ((len < 0) || (ofs != st.st_size))
+		return false;
+
+	memset(key, 0, sizeof(*key));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->hash = hash;
+
+	return true;
+}
+
+static char *uci_cache_dir(struct uci_context *ctx)
+{
+	char *dir = NULL;
+
+	if ((asprintf(&dir, "%s.cache", ctx->savedir) < 0) || !dir)
+		return NULL;
+
+	return dir;
+}
+
+static char *uci_cache_path(struct uci_context *ctx, const char *name)
+{
+	char *filename = NULL;
+
+	if ((asprintf(&filename, "%s.cache/%s", ctx->savedir, name) < 0) || !filename)
+		return NULL;
+
+	return filename;
+}
+
+static char *uci_daemon_path(const char *name)
+{
+	char *filename = NULL;
+
+	if ((asprintf(&filename, "%s/%s", UCI_SNAPSHOTDIR, name) < 0) || !filename)
+		return NULL;
+
+	return filename;
+}
+
+/*
+ * the cache is only trusted if nobody else could have written it.
+ * snapshots may also come from a daemon running as root
+ */
+static bool uci_cache_trusted(struct stat *st, bool daemon)
+{
+	if ((st->st_uid != geteuid()) && (!daemon || st->st_uid))
+		return false;
+
+	return !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+static inline const char *
+uci_cache_str(const char *strtab, uint32_t size, uint32_t ofs)
+{
+	return (ofs < size) ? strtab + ofs : NULL;
+}
+
+/* check that every count and string offset stays within the file */
+static bool uci_cache_valid(const char *map, size_t size)
+{
+	const struct uci_cache_header *h = (const void *) map;
+	const struct uci_cache_section *cs;
+	const struct uci_cache_option *co;
+	const uint32_t *values;
+	const char *strtab;
+	uint64_t total;
+	uint32_t i, n_options = 0, n_values = 0;
+
+	total = sizeof(*h) +
+		(uint64_t) h->n_sections * sizeof(*cs) +
+		(uint64_t) h->n_options * sizeof(*co) +
+		(uint64_t) h->n_values * sizeof(uint32_t) +
+		h->strtab_size;
+	if ((total != size) || !h->strtab_size || map[size - 1])
+		return false;
+
+	cs = (const void *) (h + 1);
+	co = (const void *) (cs + h->n_sections);
+	values = (const void *) (co + h->n_options);
+	strtab = (const char *) (values + h->n_values);
+
+	for (i = 0; i < h->n_sections; i++) {
+		if (!uci_cache_str(strtab, h->strtab_size, cs[i].type) ||
+			!uci_cache_str(strtab, h->strtab_size, cs[i].name))
+			return false;
+		n_options += cs[i].n_options;
+		if (n_options > h->n_options)
+			return false;
+	}
+	for (i = 0; i < h->n_options; i++) {
+		if (!uci_cache_str(strtab, h->strtab_size, co[i].name) || !co[i].n_values)
+			return false;
+		n_values += co[i].n_values;
+		if (n_values > h->n_values)
+			return false;
+	}
+	for (i = 0; i < h->n_values; i++) {
+		if (!uci_cache_str(strtab, h->strtab_size, values[i]))
+			return false;
+	}
+
+	return (n_options == h->n_options) && (n_values == h->n_values);
+}
+
+static void uci_cache_build(struct uci_context *ctx, struct uci_package *p, const char *map)
+{
+	const struct uci_cache_header *h = (const void *) map;
+	const struct uci_cache_section *cs = (const void *) (h + 1);
+	const struct uci_cache_option *co = (const void *) (cs + h->n_sections);
+	const uint32_t *values = (const void *) (co + h->n_options);
+	const char *strtab = (const char *) (values + h->n_values);
+	struct uci_ptr ptr;
+	uint32_t i, j, k;
+
+	for (i = 0; i < h->n_sections; i++, cs++) {
+		memset(&ptr, 0, sizeof(ptr));
+		ptr.p = p;
+		ptr.package = p->e.name;
+		ptr.section = strtab + cs->name;
+		ptr.value = strtab + cs->type;
+		ptr.flags = UCI_LOOKUP_DONE;
+		if (!uci_validate_name(ptr.section))
+			UCI_THROW(ctx, UCI_ERR_PARSE);
+		UCI_INTERNAL(uci_set, ctx, &ptr);
+		if (!ptr.s)
+			UCI_THROW(ctx, UCI_ERR_PARSE);
+		ptr.s->anonymous = !!(cs->flags & UCI_CACHE_ANONYMOUS);
+
+		for (j = 0; j < cs->n_options; j++, co++) {
+			ptr.o = NULL;
+			ptr.option = strtab + co->name;
+			if (!uci_validate_name(ptr.option))
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+			for (k = 0; k < co->n_values; k++) {
+				ptr.value = strtab + *(values++);
+				if (co->flags & UCI_CACHE_LIST)
+					UCI_INTERNAL(uci_add_list, ctx, &ptr);
+				else
+					UCI_INTERNAL(uci_set, ctx, &ptr);
+			}
+		}
+	}
+	p->n_section = h->n_section;
+}
+
+/* map a cache file if it was built from the config file identified by key */
+static char *uci_cache_open(const char *filename, const struct uci_cache_key *key,
+			    bool daemon, size_t *size)
+{
+	const struct uci_cache_header *h;
+	char *map = MAP_FAILED;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && uci_cache_trusted(&st, daemon) &&
+		(st.st_size > sizeof(*h)))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = (const void *) map;
+	if ((h->magic != UCI_CACHE_MAGIC) || (h->version != UCI_CACHE_VERSION) ||
+		memcmp(&h->key, key, sizeof(*key)) != 0 ||
+		!uci_cache_valid(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return map;
+}
+
+/* ask ucid to publish a snapshot of a package, false if it could not */
+static bool uci_daemon_request(const char *name)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct timeval tv = { .tv_sec = 1 };
+	char reply[16];
+	bool ret = false;
+	ssize_t len;
+	int fd;
+
+	strncpy(sun.sun_path, UCI_DAEMON_SOCKET, sizeof(sun.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	/* a stuck daemon must not block the reader for long */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if ((connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) ||
+		(send(fd, name, strlen(name), MSG_NOSIGNAL) < 0) ||
+		(send(fd, "\n", 1, MSG_NOSIGNAL) < 0))
+		goto out;
+
+	/* the reply is the serial of the snapshot, or a negative error code */
+	len = recv(fd, reply, sizeof(reply) - 1, 0);
+	ret = (len > 0) && (reply[0] != '-');
+
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * map the cache or the daemon snapshot of the config file that is open for
+ * reading as stream. returns NULL if there is no usable one
+ */
+static char *uci_cache_map(struct uci_context *ctx, FILE *stream, const char *name,
+			   bool daemon, size_t *size)
+{
+	struct uci_cache_key key;
+	char *filename, *map;
+
+	if (uci_lookup_list(&ctx->root, name))
+		return NULL;
+
+	/* without a running daemon, its snapshots are not kept current */
+	if (daemon && (access(UCI_DAEMON_SOCKET, F_OK) < 0))
+		return NULL;
+
+	if (!uci_cache_key(stream, &key))
+		return NULL;
+
+	filename = daemon ? uci_daemon_path(name) : uci_cache_path(ctx, name);
+	if (!filename)
+		return NULL;
+
+	map = uci_cache_open(filename, &key, daemon, size);
+	if (!map && daemon && uci_daemon_request(name))
+		map = uci_cache_open(filename, &key, daemon, size);
+	free(filename);
+
+	return map;
+}
+
+/* build a package from the cache of a config file */
+__private struct uci_package *
+uci_cache_load(struct uci_context *ctx, FILE *stream, const char *name, bool daemon)
+{
+	struct uci_package *p = NULL;
+	size_t size;
+	char *map;
+
+	map = uci_cache_map(ctx, stream, name, daemon, &size);
+	if (!map)
+		return NULL;
+
+	UCI_TRAP_SAVE(ctx, error);
+	p = uci_alloc_package(ctx, name);
+	uci_cache_build(ctx, p, map);
+	UCI_TRAP_RESTORE(ctx);
+
+	p->backend = ctx->backend;
+	uci_list_add(&ctx->root, &p->e.list);
+	goto out;
+
+error:
+	/* fall back to parsing the config file */
+	uci_free_package(&p);
+	ctx->err = 0;
+out:
+	munmap(map, size);
+	return p;
+}
+
+/* allocate the elements for a view of the cache file at map */
+static struct uci_view *uci_view_alloc(void *map, size_t size)
+{
+	const struct uci_cache_header *h = map;
+	struct uci_view *v;
+
+	v = calloc(1, sizeof(*v));
+	if (!v)
+		return NULL;
+
+	v->elements = calloc(1, h->n_sections * sizeof(struct uci_section) +
+		h->n_options * sizeof(struct uci_option) +
+		h->n_values * sizeof(struct uci_element));
+	if (!v->elements) {
+		free(v);
+		return NULL;
+	}
+	v->map = map;
+	v->size = size;
+
+	return v;
+}
+
+static void uci_view_build(struct uci_context *ctx, struct uci_package *p, struct uci_view *v)
+{
+	const struct uci_cache_header *h = v->map;
+	const struct uci_cache_section *cs = (const void *) (h + 1);
+	const struct uci_cache_option *co = (const void *) (cs + h->n_sections);
+	const uint32_t *values = (const void *) (co + h->n_options);
+	char *strtab = (char *) (values + h->n_values);
+	struct uci_section *s = v->elements;
+	struct uci_option *o = (void *) (s + h->n_sections);
+	struct uci_element *item = (void *) (o + h->n_options);
+	uint32_t i, j, k;
+
+	for (i = 0; i < h->n_sections; i++, cs++, s++) {
+		if (!uci_validate_name(strtab + cs->name) ||
+			!uci_validate_type(strtab + cs->type))
+			UCI_THROW(ctx, UCI_ERR_PARSE);
+
+		s->e.type = UCI_TYPE_SECTION;
+		s->e.name = strtab + cs->name;
+		s->type = uci_intern(ctx, strtab + cs->type);
+		s->package = p;
+		s->anonymous = !!(cs->flags & UCI_CACHE_ANONYMOUS);
+		uci_list_init(&s->options);
+		uci_list_add(&p->sections, &s->e.list);
+
+		for (j = 0; j < cs->n_options; j++, co++, o++) {
+			if (!uci_validate_name(strtab + co->name))
+				UCI_THROW(ctx, UCI_ERR_PARSE);
+
+			/* option names are compared by address, like types */
+			o->e.type = UCI_TYPE_OPTION;
+			o->e.name = uci_intern(ctx, strtab + co->name);
+			o->section = s;
+			uci_list_add(&s->options, &o->e.list);
+			if (!(co->flags & UCI_CACHE_LIST)) {
+				o->type = UCI_TYPE_STRING;
+				o->v.string = strtab + *(values++);
+				continue;
+			}
+
+			o->type = UCI_TYPE_LIST;
+			uci_list_init(&o->v.list);
+			for (k = 0; k < co->n_values; k++, item++) {
+				item->type = UCI_TYPE_ITEM;
+				item->name = strtab + *(values++);
+				uci_list_add(&o->v.list, &item->list);
+			}
+		}
+	}
+	p->n_section = h->n_section;
+}
+
+/*
+ * build a read-only package that uses the mapped cache of a config file
+ * directly. the mapping is shared with all other processes viewing the
+ * same package
+ */
+__private struct uci_package *
+uci_cache_view(struct uci_context *ctx, FILE *stream, const char *name, bool daemon)
+{
+	struct uci_package *p = NULL;
+	struct uci_view *v;
+	size_t size;
+	char *map;
+
+	map = uci_cache_map(ctx, stream, name, daemon, &size);
+	if (!map)
+		return NULL;
+
+	v = uci_view_alloc(map, size);
+	if (!v) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	UCI_TRAP_SAVE(ctx, error);
+	p = uci_alloc_package(ctx, name);
+	p->view = v;
+	p->readonly = true;
+	uci_view_build(ctx, p, v);
+	UCI_TRAP_RESTORE(ctx);
+
+	p->backend = ctx->backend;
+	uci_list_add(&ctx->root, &p->e.list);
+	return p;
+
+error:
+	if (p) {
+		uci_list_init(&p->sections);
+		uci_free_package(&p);
+	} else {
+		uci_view_free(v);
+	}
+	ctx->err = 0;
+	return NULL;
+}
+
+__private void uci_view_free(struct uci_view *v)
+{
+	if (v->heap)
+		free(v->map);
+	else
+		munmap(v->map, v->size);
+	free(v->elements);
+	free(v);
+}
+
+static void uci_cache_count(struct uci_package *p, struct uci_cache_header *h)
+{
+	struct uci_element *e, *oe, *ve;
+
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		h->n_sections++;
+		h->strtab_size += strlen(s->type) + strlen(e->name) + 2;
+		uci_foreach_element(&s->options, oe) {
+			struct uci_option *o = uci_to_option(oe);
+
+			h->n_options++;
+			h->strtab_size += strlen(oe->name) + 1;
+			if (o->type == UCI_TYPE_STRING) {
+				h->n_values++;
+				h->strtab_size += strlen(o->v.string) + 1;
+				continue;
+			}
+			uci_foreach_element(&o->v.list, ve) {
+				h->n_values++;
+				h->strtab_size += strlen(ve->name) + 1;
+			}
+		}
+	}
+
+	/* an empty string terminates the string table */
+	h->strtab_size++;
+}
+
+static uint32_t uci_cache_addstr(char *strtab, uint32_t *ofs, const char *str)
+{
+	uint32_t ret = *ofs;
+	int len = strlen(str) + 1;
+
+	memcpy(strtab + ret, str, len);
+	*ofs += len;
+
+	return ret;
+}
+
+/* lay out a package in a buffer sized by uci_cache_count */
+static void uci_cache_fill(struct uci_package *p, struct uci_cache_header *h)
+{
+	struct uci_cache_section *cs = (void *) (h + 1);
+	struct uci_cache_option *co = (void *) (cs + h->n_sections);
+	uint32_t *values = (void *) (co + h->n_options);
+	char *strtab = (char *) (values + h->n_values);
+	struct uci_element *e, *oe, *ve;
+	uint32_t ofs = 0;
+
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		cs->type = uci_cache_addstr(strtab, &ofs, s->type);
+		cs->name = uci_cache_addstr(strtab, &ofs, e->name);
+		cs->n_options = 0;
+		cs->flags = s->anonymous ? UCI_CACHE_ANONYMOUS : 0;
+		uci_foreach_element(&s->options, oe) {
+			struct uci_option *o = uci_to_option(oe);
+
+			co->name = uci_cache_addstr(strtab, &ofs, oe->name);
+			if (o->type == UCI_TYPE_STRING) {
+				co->n_values = 1;
+				co->flags = 0;
+				*(values++) = uci_cache_addstr(strtab, &ofs, o->v.string);
+			} else {
+				co->n_values = 0;
+				co->flags = UCI_CACHE_LIST;
+				uci_foreach_element(&o->v.list, ve) {
+					co->n_values++;
+					*(values++) = uci_cache_addstr(strtab, &ofs, ve->name);
+				}
+			}
+			cs->n_options++;
+			co++;
+		}
+		cs++;
+	}
+	strtab[ofs] = 0;
+}
+
+/* lay out a package as a cache file in a new buffer */
+static struct uci_cache_header *
+uci_cache_image(struct uci_package *p, const struct uci_cache_key *key, size_t *size)
+{
+	struct uci_cache_header *h, *tmp;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	uci_cache_count(p, h);
+	*size = sizeof(*h) +
+		h->n_sections * sizeof(struct uci_cache_section) +
+		h->n_options * sizeof(struct uci_cache_option) +
+		h->n_values * sizeof(uint32_t) +
+		h->strtab_size;
+	tmp = realloc(h, *size);
+	if (!tmp) {
+		free(h);
+		return NULL;
+	}
+	h = tmp;
+
+	h->magic = UCI_CACHE_MAGIC;
+	h->version = UCI_CACHE_VERSION;
+	h->key = *key;
+	h->n_section = p->n_section;
+	uci_cache_fill(p, h);
+
+	return h;
+}
+
+/* replace a cache file atomically, readers never see partial files */
+static bool uci_cache_write(const char *filename, const void *data, size_t size, mode_t mode)
+{
+	char *tmp = NULL;
+	bool ret = false;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", filename) < 0)
+		return false;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	if ((write(fd, data, size) == size) && (fchmod(fd, mode) == 0) &&
+		(rename(tmp, filename) == 0))
+		ret = true;
+	else
+		unlink(tmp);
+	close(fd);
+
+out:
+	free(tmp);
+	return ret;
+}
+
+/*
+ * write the cache for a freshly parsed package. failures are ignored,
+ * the config file is simply parsed again next time
+ */
+__private void uci_cache_save(struct uci_context *ctx, FILE *stream, struct uci_package *p)
+{
+	struct uci_cache_header *h = NULL;
+	char *dir, *filename = NULL;
+	struct uci_cache_key key;
+	struct stat st;
+	size_t size;
+
+	/* without strict mode, lines with errors were skipped silently */
+	if (!(ctx->flags & UCI_FLAG_STRICT))
+		return;
+
+	if (!uci_cache_key(stream, &key))
+		return;
+
+	dir = uci_cache_dir(ctx);
+	if (!dir)
+		return;
+
+	if (lstat(dir, &st) < 0) {
+		if (mkdir(dir, UCI_DIRMODE) < 0)
+			goto out;
+	} else if (!S_ISDIR(st.st_mode) || !uci_cache_trusted(&st, false)) {
+		goto out;
+	}
+
+	filename = uci_cache_path(ctx, p->e.name);
+	if (!filename)
+		goto out;
+
+	h = uci_cache_image(p, &key, &size);
+	if (h)
+		uci_cache_write(filename, h, size, UCI_FILEMODE);
+
+out:
+	free(h);
+	free(filename);
+	free(dir);
+}
+
+/*
+ * publish a snapshot of a package that was parsed from stream in dir.
+ * the snapshot is readable by everybody who may read the config file
+ */
+__private bool uci_cache_publish(FILE *stream, struct uci_package *p, const char *dir, uint32_t serial)
+{
+	struct uci_cache_header *h;
+	struct uci_cache_key key;
+	char *filename = NULL;
+	struct stat st;
+	size_t size;
+	bool ret = false;
+
+	if ((fstat(fileno(stream), &st) < 0) || !uci_cache_key(stream, &key))
+		return false;
+
+	if ((asprintf(&filename, "%s/%s", dir, p->e.name) < 0) || !filename)
+		return false;
+
+	h = uci_cache_image(p, &key, &size);
+	if (h) {
+		h->serial = serial;
+		ret = uci_cache_write(filename, h, size, st.st_mode & 0644);
+	}
+
+	free(h);
+	free(filename);
+	return ret;
+}
+
+/* drop the cache of a package, e.g. after its config file was rewritten */
+__private void uci_cache_remove(struct uci_context *ctx, const char *name)
+{
+	char *filename;
+
+	filename = uci_cache_path(ctx, name);
+	if (!filename)
+		return;
+
+	unlink(filename);
+	free(filename);
+}
+
+/*
+ * a snapshot is a frozen view of a cache image that is laid out in memory.
+ * its types and option names are interned in a table of its own, so it
+ * neither changes with the package nor depends on the context it was
+ * taken from
+ */
+int uci_snapshot(struct uci_context *ctx, struct uci_package *p, struct uci_snapshot **snapshot)
+{
+	struct uci_intern *intern = ctx->intern;
+	struct uci_cache_header *h;
+	struct uci_package *n = NULL;
+	struct uci_cache_key key;
+	struct uci_snapshot *s;
+	struct uci_view *v = NULL;
+	size_t size;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT(ctx, snapshot != NULL);
+
+	uci_parse_lazy_package(ctx, p);
+
+	memset(&key, 0, sizeof(key));
+	s = calloc(1, sizeof(*s));
+	h = s ? uci_cache_image(p, &key, &size) : NULL;
+	if (h)
+		v = uci_view_alloc(h, size);
+	if (!v) {
+		free(h);
+		free(s);
+		UCI_THROW(ctx, UCI_ERR_MEM);
+	}
+	v->heap = true;
+
+	ctx->intern = NULL;
+	UCI_TRAP_SAVE(ctx, error);
+	n = uci_alloc_package(ctx, p->e.name);
+	n->view = v;
+	uci_view_build(ctx, n, v);
+	UCI_INTERNAL(uci_freeze, ctx, n);
+	UCI_TRAP_RESTORE(ctx);
+
+	/* it is not owned by any context */
+	n->ctx = NULL;
+	s->package = n;
+	s->intern = ctx->intern;
+	s->refcount = 1;
+	*snapshot = s;
+	ctx->intern = intern;
+	return 0;
+
+error:
+	uci_intern_free(ctx->intern);
+	ctx->intern = intern;
+	free(s);
+	if (n) {
+		uci_list_init(&n->sections);
+		uci_free_package(&n);
+	} else {
+		uci_view_free(v);
+	}
+	UCI_THROW(ctx, ctx->err);
+	return 0;
+}
+
+struct uci_package *uci_snapshot_package(struct uci_snapshot *s)
+{
+	return s->package;
+}
+
+struct uci_snapshot *uci_snapshot_get(struct uci_snapshot *s)
+{
+	__atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+void uci_snapshot_put(struct uci_snapshot *s)
+{
+	if (!s || __atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	uci_free_package(&s->package);
+	uci_intern_free(s->intern);
+	free(s);
+}
+
+/*
+ * the lowest bit of a slot marks it as taken while a snapshot in it gets
+ * another reference or is replaced. nobody holds it for longer than that
+ */
+#define UCI_SNAPSHOT_BUSY	((uintptr_t) 1)
+
+static struct uci_snapshot *uci_snapshot_lock(struct uci_snapshot **slot)
+{
+	struct uci_snapshot *s;
+
+	do {
+		s = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		s = (void *) ((uintptr_t) s & ~UCI_SNAPSHOT_BUSY);
+	} while (!__atomic_compare_exchange_n(slot, &s, (void *) ((uintptr_t) s | UCI_SNAPSHOT_BUSY),
+					      true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return s;
+}
+
+struct uci_snapshot *uci_snapshot_acquire(struct uci_snapshot **slot)
+{
+	struct uci_snapshot *s;
+
+	s = uci_snapshot_lock(slot);
+	if (s)
+		uci_snapshot_get(s);
+	__atomic_store_n(slot, s, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+void uci_snapshot_publish(struct uci_snapshot **slot, struct uci_snapshot *s)
+{
+	struct uci_snapshot *old;
+
+	old = uci_snapshot_lock(slot);
+	__atomic_store_n(slot, s, __ATOMIC_RELEASE);
+	uci_snapshot_put(old);
+}
@@ -15,9 +15,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include "uci.h"
 
-#define MAX_ARGS	4 /* max command line arguments for batch mode */
+#define MAX_ARGS	64 /* max command line arguments for batch mode */
 
 static const char *delimiter = " ";
 static const char *appname;
@@ -28,6 +29,9 @@ static enum {
 	CLI_FLAG_BATCH =    (1 << 3),
 	CLI_FLAG_SHOW_EXT = (1 << 4),
 	CLI_FLAG_NOPLUGINS= (1 << 5),
+	CLI_FLAG_KEEP =     (1 << 6),
+	CLI_FLAG_VERBOSE =  (1 << 7),
+	CLI_FLAG_JSON =     (1 << 8),
 } flags;
 
 static FILE *input;
@@ -50,6 +54,7 @@ enum {
 	/* other cmds */
 	CMD_ADD,
 	CMD_IMPORT,
+	CMD_APPLY,
 	CMD_HELP,
 };
 
@@ -59,62 +64,231 @@ struct uci_type_list {
 	struct uci_type_list *next;
 };
 
-static struct uci_type_list *type_list = NULL;
+/* section counters for @type[idx] references, hashed by type name */
+static struct uci_type_list **type_hash = NULL;
+static unsigned int type_hash_size = 0;
+static unsigned int n_types = 0;
 static char *typestr = NULL;
+static size_t typestr_size = 0;
 static const char *cur_section_ref = NULL;
 
+/* output of show and get, written to stdout in large blocks */
+static char outbuf[65536];
+static size_t outlen = 0;
+static char out_end = '\n';
+static int json_items = 0;
+
 static int uci_cmd(int argc, char **argv);
+static int uci_do_cmd(int cmd, int argc, char **argv);
+
+static unsigned int
+uci_type_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619u;
+
+	return h;
+}
 
 static void
 uci_reset_typelist(void)
 {
 	struct uci_type_list *type;
-	while (type_list != NULL) {
-			type = type_list;
-			type_list = type_list->next;
+	unsigned int i;
+
+	for (i = 0; i < type_hash_size; i++) {
+		while (type_hash[i] != NULL) {
+			type = type_hash[i];
+			type_hash[i] = type->next;
 			free(type);
+		}
 	}
-	if (typestr) {
-		free(typestr);
-		typestr = NULL;
-	}
+	free(type_hash);
+	type_hash = NULL;
+	type_hash_size = 0;
+	n_types = 0;
+	free(typestr);
+	typestr = NULL;
+	typestr_size = 0;
 	cur_section_ref = NULL;
 }
 
+static bool
+uci_grow_typelist(void)
+{
+	struct uci_type_list **hash, *ti;
+	unsigned int size = type_hash_size ? type_hash_size * 2 : 16;
+	unsigned int i, h;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return false;
+
+	for (i = 0; i < type_hash_size; i++) {
+		while ((ti = type_hash[i]) != NULL) {
+			type_hash[i] = ti->next;
+			h = uci_type_hash(ti->name) & (size - 1);
+			ti->next = hash[h];
+			hash[h] = ti;
+		}
+	}
+	free(type_hash);
+	type_hash = hash;
+	type_hash_size = size;
+
+	return true;
+}
+
 static char *
 uci_lookup_section_ref(struct uci_section *s)
 {
-	struct uci_type_list *ti = type_list;
-	int maxlen;
+	struct uci_type_list *ti = NULL;
+	unsigned int h, idx;
+	size_t len, maxlen;
+	char num[12], *p;
 
 	if (!s->anonymous || !(flags & CLI_FLAG_SHOW_EXT))
 		return s->e.name;
 
 	/* look up in section type list */
-	while (ti) {
-		if (strcmp(ti->name, s->type) == 0)
-			break;
-		ti = ti->next;
-	}
-	if (!ti) {
-		ti = malloc(sizeof(struct uci_type_list));
-		memset(ti, 0, sizeof(struct uci_type_list));
-		ti->next = type_list;
-		type_list = ti;
-		ti->name = s->type;
+	if ((n_types < type_hash_size) || uci_grow_typelist()) {
+		h = uci_type_hash(s->type) & (type_hash_size - 1);
+		for (ti = type_hash[h]; ti; ti = ti->next) {
+			if (strcmp(ti->name, s->type) == 0)
+				break;
+		}
+		if (!ti) {
+			ti = calloc(1, sizeof(struct uci_type_list));
+			if (ti) {
+				ti->name = s->type;
+				ti->next = type_hash[h];
+				type_hash[h] = ti;
+				n_types++;
+			}
+		}
 	}
+	if (!ti)
+		return s->e.name;
 
-	maxlen = strlen(s->type) + 1 + 2 + 10;
-	if (!typestr) {
-		typestr = malloc(maxlen);
-	} else {
-		typestr = realloc(typestr, maxlen);
+	len = strlen(s->type);
+	maxlen = len + 1 + 2 + 10 + 1;
+	if (typestr_size < maxlen) {
+		p = realloc(typestr, maxlen);
+		if (!p)
+			return s->e.name;
+		typestr = p;
+		typestr_size = maxlen;
 	}
-	sprintf(typestr, "@%s[%d]", ti->name, ti->idx);
-	ti->idx++;
+
+	p = num + sizeof(num);
+	idx = ti->idx++;
+	do {
+		*--p = '0' + idx % 10;
+		idx /= 10;
+	} while (idx);
+
+	typestr[0] = '@';
+	memcpy(typestr + 1, s->type, len);
+	typestr[len + 1] = '[';
+	memcpy(typestr + len + 2, p, num + sizeof(num) - p);
+	len += 2 + (num + sizeof(num) - p);
+	typestr[len++] = ']';
+	typestr[len] = 0;
+
 	return typestr;
 }
 
+static void out_flush(void)
+{
+	fwrite(outbuf, 1, outlen, stdout);
+	outlen = 0;
+}
+
+static void out_write(const char *str, size_t len)
+{
+	if (len > sizeof(outbuf) - outlen) {
+		out_flush();
+		if (len > sizeof(outbuf)) {
+			fwrite(str, 1, len, stdout);
+			return;
+		}
+	}
+	memcpy(outbuf + outlen, str, len);
+	outlen += len;
+}
+
+static void out_puts(const char *str)
+{
+	out_write(str, strlen(str));
+}
+
+static void out_putc(char c)
+{
+	if (outlen == sizeof(outbuf))
+		out_flush();
+	outbuf[outlen++] = c;
+}
+
+static void out_json_string(const char *str)
+{
+	const char *start = str;
+	char esc[8];
+
+	out_putc('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if ((c >= 0x20) && (c != '"') && (c != '\\'))
+			continue;
+
+		out_write(start, str - start);
+		start = str + 1;
+		switch(c) {
+		case '"':
+			out_puts("\\\"");
+			break;
+		case '\\':
+			out_puts("\\\\");
+			break;
+		case '\n':
+			out_puts("\\n");
+			break;
+		case '\t':
+			out_puts("\\t");
+			break;
+		default:
+			sprintf(esc, "\\u%04x", c);
+			out_puts(esc);
+			break;
+		}
+	}
+	out_write(start, str - start);
+	out_putc('"');
+}
+
+/* show -j prints one JSON object with the packages as members */
+static void out_json_begin(void)
+{
+	out_putc('{');
+	json_items = 0;
+}
+
+static void out_json_end(void)
+{
+	out_puts("}\n");
+	out_flush();
+}
+
+static void out_json_key(const char *key)
+{
+	if (json_items++)
+		out_putc(',');
+	out_json_string(key);
+	out_putc(':');
+}
+
 static void uci_usage(void)
 {
 	fprintf(stderr,
@@ -123,8 +297,9 @@ static void uci_usage(void)
 		"\tbatch\n"
 		"\texport     [<config>]\n"
 		"\timport     [<config>]\n"
+		"\tapply\n"
 		"\tchanges    [<config>]\n"
-		"\tcommit     [<config>]\n"
+		"\tcommit     [<config>...]\n"
 		"\tadd        <config> <section-type>\n"
 		"\tadd_list   <config>.<section>.<option>=<string>\n"
 		"\tshow       [<config>[.<section>[.<option>]]]\n"
@@ -136,9 +311,15 @@ static void uci_usage(void)
 		"\treorder    <config>.<section>=<position>\n"
 		"\n"
 		"Options:\n"
+		"\t-0         end the lines of 'show' and 'get' with a NUL byte instead of a newline\n"
+		"\t-b         write new config change files in the binary format\n"
 		"\t-c <path>  set the search path for config files (default: /etc/config)\n"
+		"\t-C         keep compiled copies of config files next to the change files\n"
 		"\t-d <str>   set the delimiter for list values in uci show\n"
+		"\t-D         read configs from the snapshots of ucid if it is running\n"
 		"\t-f <file>  use <file> as input instead of stdin\n"
+		"\t-j         print the output of 'show' and 'get' as JSON\n"
+		"\t-k         keep configs loaded in batch mode, save changes at commit or exit\n"
 		"\t-L         do not load any plugins\n"
 		"\t-m         when importing, merge data into an existing package\n"
 		"\t-n         name unnamed sections on export (default)\n"
@@ -148,6 +329,7 @@ static void uci_usage(void)
 		"\t-q         quiet mode (don't print error messages)\n"
 		"\t-s         force strict mode (stop on parser errors, default)\n"
 		"\t-S         disable strict mode\n"
+		"\t-v         print statistics for apply\n"
 		"\t-X         do not use extended syntax on 'show'\n"
 		"\n",
 		appname
@@ -162,34 +344,107 @@ static void cli_perror(void)
 	uci_perror(ctx, appname);
 }
 
+/*
+ * with -k, packages stay loaded between the commands of a batch and their
+ * changes are kept in memory. packages outside of the config directory
+ * have no change file, their changes are still written right away
+ */
+static bool cli_keep(struct uci_package *p)
+{
+	return (flags & CLI_FLAG_BATCH) && (flags & CLI_FLAG_KEEP) && p->has_delta;
+}
+
+static void cli_unload(bool save)
+{
+	struct uci_element *e, *tmp;
+
+	uci_foreach_element_safe(&ctx->root, tmp, e) {
+		struct uci_package *p = uci_to_package(e);
+
+		if (save && p->has_delta && (uci_save(ctx, p) != UCI_OK))
+			cli_perror();
+		uci_unload(ctx, p);
+	}
+}
+
+/* pick up the changes that others made to the files of kept packages */
+static void cli_reload(void)
+{
+	struct uci_element *e, *tmp;
+
+	uci_foreach_element_safe(&ctx->root, tmp, e) {
+		struct uci_package *p = uci_to_package(e);
+
+		if (uci_reload(ctx, p) == UCI_OK)
+			continue;
+
+		cli_perror();
+		if (uci_save(ctx, p) != UCI_OK)
+			cli_perror();
+		uci_unload(ctx, p);
+	}
+}
+
 static void uci_show_value(struct uci_option *o)
 {
 	struct uci_element *e;
 	bool sep = false;
 
+	if (flags & CLI_FLAG_JSON) {
+		switch(o->type) {
+		case UCI_TYPE_STRING:
+			out_json_string(o->v.string);
+			break;
+		case UCI_TYPE_LIST:
+			out_putc('[');
+			uci_foreach_element(&o->v.list, e) {
+				if (sep)
+					out_putc(',');
+				out_json_string(e->name);
+				sep = true;
+			}
+			out_putc(']');
+			break;
+		default:
+			out_puts("null");
+			break;
+		}
+		return;
+	}
+
 	switch(o->type) {
 	case UCI_TYPE_STRING:
-		printf("%s\n", o->v.string);
+		out_puts(o->v.string);
 		break;
 	case UCI_TYPE_LIST:
 		uci_foreach_element(&o->v.list, e) {
-			printf("%s%s", (sep ? delimiter : ""), e->name);
+			if (sep)
+				out_puts(delimiter);
+			out_puts(e->name);
 			sep = true;
 		}
-		printf("\n");
 		break;
 	default:
-		printf("<unknown>\n");
+		out_puts("<unknown>");
 		break;
 	}
+	out_putc(out_end);
 }
 
 static void uci_show_option(struct uci_option *o)
 {
-	printf("%s.%s.%s=",
-		o->section->package->e.name,
-		(cur_section_ref ? cur_section_ref : o->section->e.name),
-		o->e.name);
+	if (flags & CLI_FLAG_JSON) {
+		out_json_key(o->e.name);
+		uci_show_value(o);
+		return;
+	}
+
+	out_puts(o->section->package->e.name);
+	out_putc('.');
+	out_puts(cur_section_ref ? cur_section_ref : o->section->e.name);
+	out_putc('.');
+	out_puts(o->e.name);
+	out_putc('=');
 	uci_show_value(o);
 }
 
@@ -201,7 +456,30 @@ static void uci_show_section(struct uci_section *s)
 
 	cname = s->package->e.name;
 	sname = (cur_section_ref ? cur_section_ref : s->e.name);
-	printf("%s.%s=%s\n", cname, sname, s->type);
+
+	if (flags & CLI_FLAG_JSON) {
+		out_json_key(sname);
+		out_puts("{\".type\":");
+		out_json_string(s->type);
+		out_puts(",\".name\":");
+		out_json_string(s->e.name);
+		out_puts(s->anonymous ? ",\".anonymous\":true" : ",\".anonymous\":false");
+		json_items = 1;
+		uci_foreach_element(&s->options, e) {
+			uci_show_option(uci_to_option(e));
+		}
+		out_putc('}');
+		/* the enclosing object has members now */
+		json_items = 1;
+		return;
+	}
+
+	out_puts(cname);
+	out_putc('.');
+	out_puts(sname);
+	out_putc('=');
+	out_puts(s->type);
+	out_putc(out_end);
 	uci_foreach_element(&s->options, e) {
 		uci_show_option(uci_to_option(e));
 	}
@@ -263,12 +541,6 @@ static int package_cmd(int cmd, char *tuple)
 	case CMD_CHANGES:
 		uci_show_changes(ptr.p);
 		break;
-	case CMD_COMMIT:
-		if (flags & CLI_FLAG_NOCOMMIT)
-			return 0;
-		if (uci_commit(ctx, &ptr.p, false) != UCI_OK)
-			cli_perror();
-		break;
 	case CMD_EXPORT:
 		uci_export(ctx, stdout, ptr.p, true);
 		break;
@@ -278,6 +550,11 @@ static int package_cmd(int cmd, char *tuple)
 			cli_perror();
 			return 1;
 		}
+		if (flags & CLI_FLAG_JSON) {
+			out_json_key(ptr.p->e.name);
+			out_putc('{');
+			json_items = 0;
+		}
 		switch(e->type) {
 			case UCI_TYPE_PACKAGE:
 				uci_show_package(ptr.p);
@@ -286,16 +563,30 @@ static int package_cmd(int cmd, char *tuple)
 				uci_show_section(ptr.s);
 				break;
 			case UCI_TYPE_OPTION:
-				uci_show_option(ptr.o);
+				if (flags & CLI_FLAG_JSON) {
+					out_json_key(ptr.s->e.name);
+					out_putc('{');
+					json_items = 0;
+					uci_show_option(ptr.o);
+					out_putc('}');
+				} else {
+					uci_show_option(ptr.o);
+				}
 				break;
 			default:
 				/* should not happen */
 				return 1;
 		}
+		if (flags & CLI_FLAG_JSON) {
+			out_putc('}');
+			json_items = 1;
+		}
+		out_flush();
 		break;
 	}
 
-	uci_unload(ctx, ptr.p);
+	if (!cli_keep(ptr.p))
+		uci_unload(ctx, ptr.p);
 	return 0;
 }
 
@@ -347,10 +638,22 @@ static int uci_do_package_cmd(int cmd, int argc, char **argv)
 {
 	char **configs = NULL;
 	char **p;
+	int n = 0;
 
 	if (argc > 2)
 		return 255;
 
+	if ((cmd == CMD_SHOW) && (flags & CLI_FLAG_JSON) && (argc == 2)) {
+		out_json_begin();
+		if (package_cmd(cmd, argv[1]) != 0) {
+			/* nothing was found, drop the opening brace */
+			outlen = 0;
+			return 1;
+		}
+		out_json_end();
+		return 0;
+	}
+
 	if (argc == 2)
 		return package_cmd(cmd, argv[1]);
 
@@ -359,13 +662,162 @@ static int uci_do_package_cmd(int cmd, int argc, char **argv)
 		return 1;
 	}
 
+	/* packages that fail to load here report their error below */
+	if ((cmd == CMD_SHOW) || (cmd == CMD_EXPORT)) {
+		while (configs[n])
+			n++;
+		uci_load_many(ctx, configs, n, NULL);
+	}
+
+	if ((cmd == CMD_SHOW) && (flags & CLI_FLAG_JSON))
+		out_json_begin();
 	for (p = configs; *p; p++) {
 		package_cmd(cmd, *p);
 	}
+	if ((cmd == CMD_SHOW) && (flags & CLI_FLAG_JSON))
+		out_json_end();
 
 	return 0;
 }
 
+/* commits all given packages together, or all packages if none are given */
+static int uci_do_commit(int argc, char **argv)
+{
+	struct uci_package **packages = NULL;
+	struct uci_ptr ptr;
+	char **configs = NULL;
+	char **names = argv + 1;
+	int i, j, n = 0;
+	int count = argc - 1;
+	int ret = 0;
+
+	if (flags & CLI_FLAG_NOCOMMIT)
+		return 0;
+
+	if (!count) {
+		if ((uci_list_configs(ctx, &configs) != UCI_OK) || !configs) {
+			cli_perror();
+			return 1;
+		}
+		names = configs;
+		while (names[count])
+			count++;
+	}
+
+	packages = calloc(count + 1, sizeof(*packages));
+	if (!packages) {
+		ret = 1;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (uci_lookup_ptr(ctx, &ptr, names[i], true) != UCI_OK) {
+			cli_perror();
+			/* only commit a partial set if none was asked for */
+			if (configs)
+				continue;
+			ret = 1;
+			goto out;
+		}
+		for (j = 0; j < n; j++) {
+			if (packages[j] == ptr.p)
+				break;
+		}
+		if (j == n)
+			packages[n++] = ptr.p;
+	}
+
+	/* a single config may still be rewritten in place, e.g. through a symlink */
+	if (n == 1)
+		ret = uci_commit(ctx, &packages[0], false);
+	else if (n)
+		ret = uci_commit_many(ctx, packages, n, false);
+	if (ret != UCI_OK) {
+		cli_perror();
+		ret = 1;
+	}
+
+out:
+	for (i = 0; i < n; i++) {
+		if (packages[i])
+			uci_unload(ctx, packages[i]);
+	}
+	free(packages);
+	free(configs);
+	return ret;
+}
+
+/*
+ * reads changes in the syntax of delta files, one per line, and saves
+ * each package once at the end. nothing is saved if a change fails, but
+ * packages are saved one after another, so if saving one of them fails,
+ * the ones saved before keep their changes
+ */
+static int uci_do_apply(int argc, char **argv)
+{
+	struct timespec start, end;
+	struct uci_element *e;
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int line = 0, changes = 0, packages = 0;
+	int ret = 0;
+	double t;
+
+	if (argc != 1)
+		return 255;
+
+	/* the changes would be read from the same input as the batch commands */
+	if (flags & CLI_FLAG_BATCH) {
+		if (!(flags & CLI_FLAG_QUIET))
+			fprintf(stderr, "%s: apply cannot be used in batch mode\n", appname);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((len = getline(&buf, &size, input)) >= 0) {
+		line++;
+		if ((len > 0) && (buf[len - 1] == '\n'))
+			buf[--len] = 0;
+		if (!len)
+			continue;
+
+		if (uci_apply_delta(ctx, buf) != UCI_OK) {
+			if (!(flags & CLI_FLAG_QUIET)) {
+				char *err = NULL;
+
+				uci_get_errorstr(ctx, &err, appname);
+				fprintf(stderr, "%s (line %d)\n", err ? err : appname, line);
+				free(err);
+			}
+			ret = 1;
+			break;
+		}
+		changes++;
+	}
+	free(buf);
+
+	if (!ret) {
+		uci_foreach_element(&ctx->root, e) {
+			if (uci_save(ctx, uci_to_package(e)) != UCI_OK) {
+				cli_perror();
+				ret = 1;
+			}
+			packages++;
+		}
+	}
+	cli_unload(false);
+
+	if (!ret && (flags & CLI_FLAG_VERBOSE)) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: applied %d changes to %d configs in %.3fs (%.0f changes/s)\n",
+			appname, changes, packages, t, (t > 0) ? changes / t : 0);
+	}
+
+	return ret;
+}
+
 static int uci_do_add(int argc, char **argv)
 {
 	struct uci_package *p = NULL;
@@ -375,7 +827,9 @@ static int uci_do_add(int argc, char **argv)
 	if (argc != 3)
 		return 255;
 
-	ret = uci_load(ctx, argv[1], &p);
+	/* the package may still be loaded from an earlier command */
+	p = uci_lookup_package(ctx, argv[1]);
+	ret = p ? UCI_OK : uci_load(ctx, argv[1], &p);
 	if (ret != UCI_OK)
 		goto done;
 
@@ -383,7 +837,8 @@ static int uci_do_add(int argc, char **argv)
 	if (ret != UCI_OK)
 		goto done;
 
-	ret = uci_save(ctx, p);
+	if (!cli_keep(p))
+		ret = uci_save(ctx, p);
 
 done:
 	if (ret != UCI_OK)
@@ -403,7 +858,12 @@ static int uci_do_section_cmd(int cmd, int argc, char **argv)
 	if (argc != 2)
 		return 255;
 
-	if (uci_lookup_ptr(ctx, &ptr, argv[1], true) != UCI_OK) {
+	/* a single value only needs the section it is in to be parsed */
+	if (cmd == CMD_GET)
+		ctx->flags |= UCI_FLAG_LAZY;
+	ret = uci_lookup_ptr(ctx, &ptr, argv[1], true);
+	ctx->flags &= ~UCI_FLAG_LAZY;
+	if (ret != UCI_OK) {
 		cli_perror();
 		return 1;
 	}
@@ -421,15 +881,24 @@ static int uci_do_section_cmd(int cmd, int argc, char **argv)
 		}
 		switch(e->type) {
 		case UCI_TYPE_SECTION:
-			printf("%s\n", ptr.s->type);
+			if (flags & CLI_FLAG_JSON) {
+				out_json_string(ptr.s->type);
+				out_putc('\n');
+			} else {
+				out_puts(ptr.s->type);
+				out_putc(out_end);
+			}
 			break;
 		case UCI_TYPE_OPTION:
 			uci_show_value(ptr.o);
+			if (flags & CLI_FLAG_JSON)
+				out_putc('\n');
 			break;
 		default:
 			break;
 		}
 		/* throw the value to stdout */
+		out_flush();
 		break;
 	case CMD_RENAME:
 		ret = uci_rename(ctx, &ptr);
@@ -461,7 +930,7 @@ static int uci_do_section_cmd(int cmd, int argc, char **argv)
 		return 0;
 
 	/* save changes, but don't commit them yet */
-	if (ret == UCI_OK)
+	if ((ret == UCI_OK) && !cli_keep(ptr.p))
 		ret = uci_save(ctx, ptr.p);
 
 	if (ret != UCI_OK) {
@@ -521,19 +990,17 @@ static int uci_batch(void)
 
 	flags |= CLI_FLAG_BATCH;
 	while (!feof(input)) {
-		struct uci_element *e, *tmp;
-
 		ret = uci_batch_cmd();
 		if (ret == 254)
-			return 0;
+			break;
 		else if (ret == 255)
 			fprintf(stderr, "Unknown command\n");
 
 		/* clean up */
-		uci_foreach_element_safe(&ctx->root, tmp, e) {
-			uci_unload(ctx, uci_to_package(e));
-		}
+		if (!(flags & CLI_FLAG_KEEP))
+			cli_unload(false);
 	}
+	cli_unload(true);
 	flags &= ~CLI_FLAG_BATCH;
 
 	return 0;
@@ -542,6 +1009,7 @@ static int uci_batch(void)
 static int uci_cmd(int argc, char **argv)
 {
 	int cmd = 0;
+	int ret;
 
 	if (!strcasecmp(argv[0], "batch") && !(flags & CLI_FLAG_BATCH))
 		return uci_batch();
@@ -569,6 +1037,8 @@ static int uci_cmd(int argc, char **argv)
 		cmd = CMD_DEL;
 	else if (!strcasecmp(argv[0], "import"))
 		cmd = CMD_IMPORT;
+	else if (!strcasecmp(argv[0], "apply"))
+		cmd = CMD_APPLY;
 	else if (!strcasecmp(argv[0], "help"))
 		cmd = CMD_HELP;
 	else if (!strcasecmp(argv[0], "add"))
@@ -578,6 +1048,33 @@ static int uci_cmd(int argc, char **argv)
 	else
 		cmd = -1;
 
+	if (!(flags & CLI_FLAG_BATCH) || !(flags & CLI_FLAG_KEEP))
+		return uci_do_cmd(cmd, argc, argv);
+
+	switch(cmd) {
+		case CMD_CHANGES:
+		case CMD_COMMIT:
+		case CMD_IMPORT:
+		case CMD_APPLY:
+		case CMD_REVERT:
+			/* these work on the files, as if nothing was kept */
+			cli_unload(true);
+			ret = uci_do_cmd(cmd, argc, argv);
+			cli_unload(false);
+			return ret;
+		default:
+			cli_reload();
+			ret = uci_do_cmd(cmd, argc, argv);
+			/* a failed command may have changed kept packages without
+			 * recording it, start over from the files like without -k */
+			if (ret != 0)
+				cli_unload(true);
+			return ret;
+	}
+}
+
+static int uci_do_cmd(int cmd, int argc, char **argv)
+{
 	switch(cmd) {
 		case CMD_ADD_LIST:
 		case CMD_GET:
@@ -589,11 +1086,14 @@ static int uci_cmd(int argc, char **argv)
 			return uci_do_section_cmd(cmd, argc, argv);
 		case CMD_SHOW:
 		case CMD_EXPORT:
-		case CMD_COMMIT:
 		case CMD_CHANGES:
 			return uci_do_package_cmd(cmd, argc, argv);
+		case CMD_COMMIT:
+			return uci_do_commit(argc, argv);
 		case CMD_IMPORT:
 			return uci_do_import(argc, argv);
+		case CMD_APPLY:
+			return uci_do_apply(argc, argv);
 		case CMD_ADD:
 			return uci_do_add(argc, argv);
 		case CMD_HELP:
@@ -617,15 +1117,26 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Out of memory\n");
 		return 1;
 	}
-
-	while((c = getopt(argc, argv, "c:d:f:LmnNp:P:sSqX")) != -1) {
+	while((c = getopt(argc, argv, "0bc:Cd:Df:jkLmnNp:P:sSqvX")) != -1) {
 		switch(c) {
+			case '0':
+				out_end = 0;
+				break;
+			case 'b':
+				ctx->flags |= UCI_FLAG_BINARY_DELTA;
+				break;
 			case 'c':
 				uci_set_confdir(ctx, optarg);
 				break;
+			case 'C':
+				ctx->flags |= UCI_FLAG_CACHE;
+				break;
 			case 'd':
 				delimiter = optarg;
 				break;
+			case 'D':
+				uci_set_backend(ctx, "ucid");
+				break;
 			case 'f':
 				input = fopen(optarg, "r");
 				if (!input) {
@@ -633,6 +1144,12 @@ int main(int argc, char **argv)
 					return 1;
 				}
 				break;
+			case 'j':
+				flags |= CLI_FLAG_JSON;
+				break;
+			case 'k':
+				flags |= CLI_FLAG_KEEP;
+				break;
 			case 'L':
 				flags |= CLI_FLAG_NOPLUGINS;
 				break;
@@ -663,6 +1180,9 @@ int main(int argc, char **argv)
 			case 'q':
 				flags |= CLI_FLAG_QUIET;
 				break;
+			case 'v':
+				flags |= CLI_FLAG_VERBOSE;
+				break;
 			case 'X':
 				flags &= ~CLI_FLAG_SHOW_EXT;
 				break;
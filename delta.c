@@ -31,25 +31,47 @@
 #include "uci.h"
 #include "uci_internal.h"
 
-/* record a change that was done to a package */
-void
-uci_add_delta(struct uci_context *ctx, struct uci_list *list, int cmd, const char *section, const char *option, const char *value)
+/* compact the delta file whenever it grows past another multiple of this */
+#define UCI_DELTA_COMPACT	16384
+
+/*
+ * allocate the record of a change, the names and the value are stored
+ * along with it
+ */
+static struct uci_delta *
+uci_alloc_delta(struct uci_context *ctx, int cmd, const char *section, const char *option, const char *value)
 {
 	struct uci_delta *h;
 	int size = strlen(section) + 1;
 	char *ptr;
 
+	if (option)
+		size += strlen(option) + 1;
 	if (value)
 		size += strlen(value) + 1;
 
-	h = uci_alloc_element(ctx, delta, option, size);
+	h = uci_alloc_element(ctx, delta, NULL, size);
 	ptr = uci_dataptr(h);
 	h->cmd = cmd;
 	h->section = strcpy(ptr, section);
-	if (value) {
+	ptr += strlen(ptr) + 1;
+	if (option) {
+		h->e.name = strcpy(ptr, option);
 		ptr += strlen(ptr) + 1;
-		h->value = strcpy(ptr, value);
 	}
+	if (value)
+		h->value = strcpy(ptr, value);
+
+	return h;
+}
+
+/* record a change that was done to a package */
+void
+uci_add_delta(struct uci_context *ctx, struct uci_list *list, int cmd, const char *section, const char *option, const char *value)
+{
+	struct uci_delta *h;
+
+	h = uci_alloc_delta(ctx, cmd, section, option, value);
 	uci_list_add(list, &h->e.list);
 }
 
@@ -58,8 +80,10 @@ uci_free_delta(struct uci_delta *h)
 {
 	if (!h)
 		return;
-	if ((h->section != NULL) &&
-		(h->section != uci_dataptr(h))) {
+	if (h->section == uci_dataptr(h)) {
+		/* allocated by uci_alloc_delta */
+		h->e.name = NULL;
+	} else if (h->section != NULL) {
 		free(h->section);
 		free(h->value);
 	}
@@ -93,6 +117,31 @@ int uci_add_delta_path(struct uci_context *ctx, const char *dir)
 	return 0;
 }
 
+/* make sure that a change read back from a delta file can be replayed */
+static void uci_check_delta(struct uci_context *ctx, int cmd, struct uci_ptr *ptr)
+{
+	if (!ptr->section)
+		goto error;
+
+	switch(cmd) {
+	case UCI_CMD_REORDER:
+		if (!ptr->value || ptr->option)
+			goto error;
+		break;
+	case UCI_CMD_RENAME:
+		if (!ptr->value || !uci_validate_name(ptr->value))
+			goto error;
+		break;
+	case UCI_CMD_LIST_ADD:
+		if (!ptr->option)
+			goto error;
+	}
+	return;
+
+error:
+	UCI_THROW(ctx, UCI_ERR_INVAL);
+}
+
 static inline int uci_parse_delta_tuple(struct uci_context *ctx, char **buf, struct uci_ptr *ptr)
 {
 	int c = UCI_CMD_CHANGE;
@@ -121,35 +170,396 @@ static inline int uci_parse_delta_tuple(struct uci_context *ctx, char **buf, str
 
 	UCI_INTERNAL(uci_parse_ptr, ctx, ptr, *buf);
 
-	if (!ptr->section)
-		goto error;
 	if (ptr->flags & UCI_LOOKUP_EXTENDED)
-		goto error;
+		UCI_THROW(ctx, UCI_ERR_INVAL);
+
+	uci_check_delta(ctx, c, ptr);
+	return c;
+}
+
+/* apply a change to the package, without recording it as delta */
+__private void uci_replay_delta(struct uci_context *ctx, int cmd, struct uci_ptr *ptr)
+{
+	struct uci_element *e = NULL;
 
-	switch(c) {
+	switch(cmd) {
 	case UCI_CMD_REORDER:
-		if (!ptr->value || ptr->option)
-			goto error;
+		uci_expand_ptr(ctx, ptr, true);
+		if (!ptr->s)
+			UCI_THROW(ctx, UCI_ERR_NOTFOUND);
+		UCI_INTERNAL(uci_reorder_section, ctx, ptr->s, strtoul(ptr->value, NULL, 10));
 		break;
 	case UCI_CMD_RENAME:
-		if (!ptr->value || !uci_validate_name(ptr->value))
-			goto error;
+		UCI_INTERNAL(uci_rename, ctx, ptr);
+		break;
+	case UCI_CMD_REMOVE:
+		UCI_INTERNAL(uci_delete, ctx, ptr);
 		break;
 	case UCI_CMD_LIST_ADD:
-		if (!ptr->option)
-			goto error;
+		UCI_INTERNAL(uci_add_list, ctx, ptr);
+		break;
+	case UCI_CMD_ADD:
+	case UCI_CMD_CHANGE:
+		UCI_INTERNAL(uci_set, ctx, ptr);
+		e = ptr->last;
+		if (!ptr->option && e && (cmd == UCI_CMD_ADD))
+			uci_to_section(e)->anonymous = true;
+		break;
 	}
+}
 
-	return c;
+int uci_apply_delta(struct uci_context *ctx, char *str)
+{
+	struct uci_ptr ptr;
+	int cmd;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, str != NULL);
+
+	cmd = uci_parse_delta_tuple(ctx, &str, &ptr);
+	UCI_INTERNAL(uci_lookup_ptr, ctx, &ptr, NULL, false);
+	uci_replay_delta(ctx, cmd, &ptr);
+
+	/* record it as it was given, to keep the anonymous flag of sections */
+	if (ptr.p->has_delta)
+		uci_add_delta(ctx, &ptr.p->delta, cmd, ptr.section, ptr.option, ptr.value);
 
-error:
-	UCI_THROW(ctx, UCI_ERR_INVAL);
 	return 0;
 }
 
+/*
+ * binary delta files start with a zero byte, which never starts a line of
+ * a text delta. every save appends a block starting with the magic, which
+ * declares the section and option names it uses once and then refers to
+ * them by their index, so that appending never needs to look at the rest
+ * of the file. records are a kind byte and the length of their payload,
+ * followed by the payload, so that unknown kinds can be skipped.
+ */
+static const char uci_delta_magic[] = { 0, 'u', 'c', 'i', 1 };
+
+#define UCI_DELTA_NAME		1	/* payload: the name */
+#define UCI_DELTA_CHANGE	0x10	/* + cmd, payload: section, option + 1, value length + 1, value */
+#define UCI_DELTA_MAXLEN	(1 << 24)
+
+struct uci_delta_name {
+	struct uci_element e;
+	size_t id;
+};
+
+struct uci_delta_out {
+	struct uci_context *ctx;
+	FILE *f;
+	struct uci_list names;
+	struct uci_hash *hash;
+	size_t count;
+	char *buf;
+	size_t len, size;
+};
+
+struct uci_delta_in {
+	struct uci_context *ctx;
+	FILE *f;
+	char **names;
+	size_t count, size;
+	char *buf;
+	size_t bufsz;
+
+	/* the last change that was read */
+	int cmd;
+	const char *section;
+	const char *option;
+	const char *value;
+};
+
+static const char *uci_delta_prefix(int cmd)
+{
+	switch(cmd) {
+	case UCI_CMD_REMOVE:
+		return "-";
+	case UCI_CMD_RENAME:
+		return "@";
+	case UCI_CMD_ADD:
+		return "+";
+	case UCI_CMD_REORDER:
+		return "^";
+	case UCI_CMD_LIST_ADD:
+		return "|";
+	default:
+		return "";
+	}
+}
+
+static bool uci_delta_is_binary(FILE *f)
+{
+	long pos = ftell(f);
+	int c;
+
+	rewind(f);
+	c = getc(f);
+	fseek(f, pos, SEEK_SET);
+	return c == 0;
+}
+
+static int uci_delta_encode_num(unsigned char *buf, size_t n)
+{
+	int len = 0;
+
+	do {
+		buf[len] = n & 0x7f;
+		n >>= 7;
+		if (n)
+			buf[len] |= 0x80;
+		len++;
+	} while (n);
+
+	return len;
+}
+
+static void uci_delta_put(struct uci_delta_out *out, const void *data, size_t len)
+{
+	if (out->len + len > out->size) {
+		out->size = (out->len + len) * 2;
+		out->buf = uci_realloc(out->ctx, out->buf, out->size);
+	}
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+}
+
+static void uci_delta_put_num(struct uci_delta_out *out, size_t n)
+{
+	unsigned char buf[10];
+
+	uci_delta_put(out, buf, uci_delta_encode_num(buf, n));
+}
+
+/* writes the collected payload as a record of the given kind */
+static void uci_delta_emit(struct uci_delta_out *out, int kind)
+{
+	unsigned char buf[11];
+	int len;
+
+	buf[0] = kind;
+	len = uci_delta_encode_num(buf + 1, out->len) + 1;
+	fwrite(buf, 1, len, out->f);
+	fwrite(out->buf, 1, out->len, out->f);
+	out->len = 0;
+}
+
+static size_t uci_delta_name(struct uci_delta_out *out, const char *name)
+{
+	struct uci_delta_name *n;
+	struct uci_element *e;
+
+	e = uci_lookup_hash(&out->hash, &out->names, name);
+	if (e)
+		return container_of(e, struct uci_delta_name, e)->id;
+
+	e = uci_alloc_generic(out->ctx, UCI_TYPE_UNSPEC, name, sizeof(struct uci_delta_name));
+	uci_list_add(&out->names, &e->list);
+	uci_hash_add(&out->hash, &out->names, e);
+	n = container_of(e, struct uci_delta_name, e);
+	n->id = out->count++;
+
+	uci_delta_put(out, name, strlen(name));
+	uci_delta_emit(out, UCI_DELTA_NAME);
+	return n->id;
+}
+
+/* appends a list of changes to a delta file in the given format */
+static void uci_write_delta(struct uci_context *ctx, FILE *f, const char *name, struct uci_list *list, bool binary)
+{
+	struct uci_delta_out out;
+	struct uci_element *e, *tmp;
+	int err = 0;
+
+	if (!binary) {
+		uci_foreach_element(list, e) {
+			struct uci_delta *h = uci_to_delta(e);
+
+			fprintf(f, "%s%s.%s", uci_delta_prefix(h->cmd), name, h->section);
+			if (e->name)
+				fprintf(f, ".%s", e->name);
+
+			if ((h->cmd == UCI_CMD_REMOVE) || !h->value)
+				fprintf(f, "\n");
+			else
+				fprintf(f, "=%s\n", h->value);
+		}
+		return;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.ctx = ctx;
+	out.f = f;
+	uci_list_init(&out.names);
+
+	UCI_TRAP_SAVE(ctx, error);
+	fwrite(uci_delta_magic, 1, sizeof(uci_delta_magic), f);
+	uci_foreach_element(list, e) {
+		struct uci_delta *h = uci_to_delta(e);
+		const char *value = (h->cmd == UCI_CMD_REMOVE) ? NULL : h->value;
+		size_t section, option = 0;
+
+		/* names have to be declared before the change refers to them */
+		section = uci_delta_name(&out, h->section);
+		if (e->name)
+			option = uci_delta_name(&out, e->name) + 1;
+
+		uci_delta_put_num(&out, section);
+		uci_delta_put_num(&out, option);
+		uci_delta_put_num(&out, value ? strlen(value) + 1 : 0);
+		if (value)
+			uci_delta_put(&out, value, strlen(value));
+		uci_delta_emit(&out, UCI_DELTA_CHANGE + h->cmd);
+	}
+	UCI_TRAP_RESTORE(ctx);
+	goto done;
+
+error:
+	err = ctx->err;
+done:
+	uci_foreach_element_safe(&out.names, tmp, e) {
+		uci_free_element(e);
+	}
+	free(out.hash);
+	free(out.buf);
+	if (err)
+		UCI_THROW(ctx, err);
+}
+
+static void uci_delta_in_init(struct uci_context *ctx, struct uci_delta_in *in, FILE *f)
+{
+	memset(in, 0, sizeof(*in));
+	in->ctx = ctx;
+	in->f = f;
+}
+
+/* forgets the names of the previous block */
+static void uci_delta_in_reset(struct uci_delta_in *in)
+{
+	while (in->count > 0)
+		free(in->names[--in->count]);
+}
+
+static void uci_delta_in_free(struct uci_delta_in *in)
+{
+	uci_delta_in_reset(in);
+	free(in->names);
+	free(in->buf);
+}
+
+static bool uci_delta_get_num(FILE *f, size_t *n)
+{
+	int shift, c;
+
+	*n = 0;
+	for (shift = 0; shift < 32; shift += 7) {
+		c = getc(f);
+		if (c == EOF)
+			return false;
+		*n |= (size_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool uci_delta_decode_num(const char **p, const char *end, size_t *n)
+{
+	int shift;
+
+	*n = 0;
+	for (shift = 0; (shift < 32) && (*p < end); shift += 7) {
+		unsigned char c = *(*p)++;
+
+		*n |= (size_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void uci_delta_add_name(struct uci_delta_in *in, size_t len)
+{
+	char *name = NULL;
+
+	if ((strlen(in->buf) == len) && uci_validate_name(in->buf))
+		name = uci_strdup(in->ctx, in->buf);
+
+	if (in->count == in->size) {
+		in->size = in->size ? in->size * 2 : 16;
+		in->names = uci_realloc(in->ctx, in->names, in->size * sizeof(char *));
+	}
+	/* invalid names are kept as NULL, changes referring to them are skipped */
+	in->names[in->count++] = name;
+}
+
+static bool uci_delta_decode(struct uci_delta_in *in, int cmd, size_t len)
+{
+	const char *p = in->buf, *end = in->buf + len;
+	size_t section, option, value;
+
+	if (!uci_delta_decode_num(&p, end, &section) ||
+	    !uci_delta_decode_num(&p, end, &option) ||
+	    !uci_delta_decode_num(&p, end, &value))
+		return false;
+
+	if ((section >= in->count) || !in->names[section])
+		return false;
+	if (option && ((option > in->count) || !in->names[option - 1]))
+		return false;
+	if (value ? ((size_t) (end - p) != value - 1) || (strlen(p) != value - 1) : (p != end))
+		return false;
+
+	in->cmd = cmd;
+	in->section = in->names[section];
+	in->option = option ? in->names[option - 1] : NULL;
+	in->value = value ? p : NULL;
+	return true;
+}
+
+/*
+ * reads the next change from a binary delta file, skipping records that
+ * cannot be used. returns false at the end of the file or where it stops
+ * making sense
+ */
+static bool uci_read_delta(struct uci_delta_in *in)
+{
+	char magic[sizeof(uci_delta_magic) - 1];
+	size_t len;
+	int kind;
+
+	while ((kind = getc(in->f)) != EOF) {
+		if (kind == 0) {
+			if ((fread(magic, 1, sizeof(magic), in->f) != sizeof(magic)) ||
+			    memcmp(magic, uci_delta_magic + 1, sizeof(magic)) != 0)
+				return false;
+			uci_delta_in_reset(in);
+			continue;
+		}
+
+		if (!uci_delta_get_num(in->f, &len) || (len > UCI_DELTA_MAXLEN))
+			return false;
+		if (len >= in->bufsz) {
+			in->bufsz = len + 1;
+			in->buf = uci_realloc(in->ctx, in->buf, in->bufsz);
+		}
+		if (fread(in->buf, 1, len, in->f) != len)
+			return false;
+		in->buf[len] = 0;
+
+		if (kind == UCI_DELTA_NAME)
+			uci_delta_add_name(in, len);
+		else if ((kind >= UCI_DELTA_CHANGE + UCI_CMD_ADD) &&
+		         (kind <= UCI_DELTA_CHANGE + UCI_CMD_LIST_ADD) &&
+		         uci_delta_decode(in, kind - UCI_DELTA_CHANGE, len))
+			return true;
+	}
+	return false;
+}
+
 static void uci_parse_delta_line(struct uci_context *ctx, struct uci_package *p, char *buf)
 {
-	struct uci_element *e = NULL;
 	struct uci_ptr ptr;
 	int cmd;
 
@@ -160,64 +570,94 @@ static void uci_parse_delta_line(struct uci_context *ctx, struct uci_package *p,
 	if (ctx->flags & UCI_FLAG_SAVED_DELTA)
 		uci_add_delta(ctx, &p->saved_delta, cmd, ptr.section, ptr.option, ptr.value);
 
-	switch(cmd) {
-	case UCI_CMD_REORDER:
-		uci_expand_ptr(ctx, &ptr, true);
-		if (!ptr.s)
-			UCI_THROW(ctx, UCI_ERR_NOTFOUND);
-		UCI_INTERNAL(uci_reorder_section, ctx, ptr.s, strtoul(ptr.value, NULL, 10));
-		break;
-	case UCI_CMD_RENAME:
-		UCI_INTERNAL(uci_rename, ctx, &ptr);
-		break;
-	case UCI_CMD_REMOVE:
-		UCI_INTERNAL(uci_delete, ctx, &ptr);
-		break;
-	case UCI_CMD_LIST_ADD:
-		UCI_INTERNAL(uci_add_list, ctx, &ptr);
-		break;
-	case UCI_CMD_ADD:
-	case UCI_CMD_CHANGE:
-		UCI_INTERNAL(uci_set, ctx, &ptr);
-		e = ptr.last;
-		if (!ptr.option && e && (cmd == UCI_CMD_ADD))
-			uci_to_section(e)->anonymous = true;
-		break;
-	}
+	uci_replay_delta(ctx, cmd, &ptr);
 	return;
 error:
 	UCI_THROW(ctx, UCI_ERR_PARSE);
 }
 
+static void uci_parse_delta_record(struct uci_context *ctx, struct uci_package *p, struct uci_delta_in *in)
+{
+	struct uci_ptr ptr;
+
+	memset(&ptr, 0, sizeof(ptr));
+	ptr.package = p->e.name;
+	ptr.section = in->section;
+	ptr.option = in->option;
+	ptr.value = in->value;
+	ptr.target = ptr.option ? UCI_TYPE_OPTION : UCI_TYPE_SECTION;
+
+	if (ptr.value && !uci_validate_text(ptr.value))
+		UCI_THROW(ctx, UCI_ERR_PARSE);
+	uci_check_delta(ctx, in->cmd, &ptr);
+
+	if (ctx->flags & UCI_FLAG_SAVED_DELTA)
+		uci_add_delta(ctx, &p->saved_delta, in->cmd, ptr.section, ptr.option, ptr.value);
+
+	uci_replay_delta(ctx, in->cmd, &ptr);
+}
+
+static int uci_parse_delta_binary(struct uci_context *ctx, FILE *stream, struct uci_package *p)
+{
+	struct uci_delta_in in;
+	volatile int changes = 0;
+	volatile bool parsing = false;
+
+	uci_delta_in_init(ctx, &in, stream);
+	UCI_TRAP_SAVE(ctx, done);
+	UCI_TRAP_LOOP(ctx, error);
+	while (uci_read_delta(&in)) {
+		parsing = true;
+		uci_parse_delta_record(ctx, p, &in);
+		changes++;
+error:
+		if (!parsing)
+			UCI_TRAP_RETHROW(ctx);
+		parsing = false;
+	}
+	UCI_TRAP_RESTORE(ctx);
+	UCI_TRAP_RESTORE(ctx);
+done:
+	uci_delta_in_free(&in);
+	return changes;
+}
+
 /* returns the number of changes that were successfully parsed */
 static int uci_parse_delta(struct uci_context *ctx, FILE *stream, struct uci_package *p)
 {
 	struct uci_parse_context *pctx;
-	int changes = 0;
+	volatile int changes = 0;
+	volatile bool parsing = false;
 
 	/* make sure no memory from previous parse attempts is leaked */
 	uci_cleanup(ctx);
 
+	if (uci_delta_is_binary(stream))
+		return uci_parse_delta_binary(ctx, stream, p);
+
 	pctx = (struct uci_parse_context *) uci_malloc(ctx, sizeof(struct uci_parse_context));
 	ctx->pctx = pctx;
 	pctx->file = stream;
 
-	while (!feof(pctx->file)) {
+	/*
+	 * ignore parse errors in single lines, we want to preserve as much
+	 * delta as possible
+	 */
+	UCI_TRAP_LOOP(ctx, error);
+	while (!uci_input_eof(pctx)) {
 		uci_getln(ctx, 0);
 		if (!pctx->buf[0])
 			continue;
 
-		/*
-		 * ignore parse errors in single lines, we want to preserve as much
-		 * delta as possible
-		 */
-		UCI_TRAP_SAVE(ctx, error);
+		parsing = true;
 		uci_parse_delta_line(ctx, p, pctx->buf);
-		UCI_TRAP_RESTORE(ctx);
 		changes++;
 error:
-		continue;
+		if (!parsing)
+			UCI_TRAP_RETHROW(ctx);
+		parsing = false;
 	}
+	UCI_TRAP_RESTORE(ctx);
 
 	/* no error happened, we can get rid of the parser context now */
 	uci_cleanup(ctx);
@@ -243,8 +683,12 @@ done:
 	return changes;
 }
 
-/* returns the number of changes that were successfully parsed */
-__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, bool flush)
+/*
+ * returns the number of changes that were successfully parsed. with flush
+ * set, the delta file is handed back locked if it had any changes, so that
+ * it can be cleared with uci_flush_delta once the config file is written
+ */
+__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, FILE **flush)
 {
 	struct uci_element *e;
 	char *filename = NULL;
@@ -265,13 +709,10 @@ __private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, boo
 	if ((asprintf(&filename, "%s/%s", ctx->savedir, p->e.name) < 0) || !filename)
 		UCI_THROW(ctx, UCI_ERR_MEM);
 
-	changes = uci_load_delta_file(ctx, p, filename, &f, flush);
-	if (flush && f && (changes > 0)) {
-		rewind(f);
-		if (ftruncate(fileno(f), 0) < 0) {
-			uci_close_stream(f);
-			UCI_THROW(ctx, UCI_ERR_IO);
-		}
+	changes = uci_load_delta_file(ctx, p, filename, &f, !!flush);
+	if (flush && (changes > 0)) {
+		*flush = f;
+		f = NULL;
 	}
 	if (filename)
 		free(filename);
@@ -280,6 +721,536 @@ __private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, boo
 	return changes;
 }
 
+/* clears and unlocks a delta file locked by uci_load_delta */
+__private void uci_flush_delta(struct uci_context *ctx, FILE *f)
+{
+	rewind(f);
+	if (ftruncate(fileno(f), 0) < 0) {
+		uci_close_stream(f);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	uci_close_stream(f);
+}
+
+/*
+ * delta compaction drops changes that a later change of the same section
+ * or option makes irrelevant, so that replaying the compacted delta gives
+ * exactly the same result, including the order of sections and options.
+ * nothing is assumed about the state of the package before the delta.
+ */
+struct uci_delta_rec;
+
+struct uci_delta_key {
+	struct uci_element e;
+	struct uci_delta_key *section;	/* NULL for the key of a section */
+	struct uci_delta_rec *last;	/* last tracked change */
+	unsigned int epoch;		/* bumped when the section changes identity */
+	unsigned int opt_epoch;		/* bumped when the section may appear or vanish */
+	bool untracked;			/* the name may be used twice */
+};
+
+struct uci_delta_rec {
+	struct uci_element e;		/* the line from the delta file */
+	struct uci_delta_key *key;
+	struct uci_delta_rec *prev;	/* previous change of the same option */
+	struct uci_delta_rec *sprev;	/* previous change in the same section */
+	unsigned int index;
+	unsigned int epoch;
+	unsigned int opt_epoch;
+	int cmd;
+	bool dropped;
+};
+
+struct uci_compact {
+	struct uci_context *ctx;
+	const char *package;
+	struct uci_list keys;
+	struct uci_hash *hash;
+	char *name;
+	size_t namesz;
+	unsigned int floor;		/* index of the last reorder */
+	int dropped;
+};
+
+static struct uci_delta_key *
+uci_compact_key(struct uci_compact *c, const char *section, const char *option)
+{
+	struct uci_delta_key *s = NULL, *k;
+	struct uci_element *e;
+	const char *name = section;
+	size_t len;
+
+	if (option) {
+		s = uci_compact_key(c, section, NULL);
+		len = strlen(section) + strlen(option) + 2;
+		if (len > c->namesz) {
+			c->name = uci_realloc(c->ctx, c->name, len);
+			c->namesz = len;
+		}
+		sprintf(c->name, "%s.%s", section, option);
+		name = c->name;
+	}
+
+	e = uci_lookup_hash(&c->hash, &c->keys, name);
+	if (e)
+		return container_of(e, struct uci_delta_key, e);
+
+	e = uci_alloc_generic(c->ctx, UCI_TYPE_UNSPEC, name, sizeof(struct uci_delta_key));
+	uci_list_add(&c->keys, &e->list);
+	uci_hash_add(&c->hash, &c->keys, e);
+	k = container_of(e, struct uci_delta_key, e);
+	k->section = s;
+	return k;
+}
+
+static void uci_compact_drop(struct uci_compact *c, struct uci_delta_rec *r)
+{
+	if (r->dropped)
+		return;
+	r->dropped = true;
+	c->dropped++;
+}
+
+static const char *uci_compact_value(struct uci_delta_rec *r)
+{
+	const char *val = strchr(r->e.name, '=');
+
+	return val ? val + 1 : "";
+}
+
+/* the change leaves the option unset */
+static bool uci_compact_erases(struct uci_delta_rec *r)
+{
+	if (r->cmd == UCI_CMD_REMOVE)
+		return true;
+	if (r->cmd == UCI_CMD_LIST_ADD)
+		return false;
+	return !*uci_compact_value(r);
+}
+
+/* the option is known not to hold the string value after the change */
+static bool uci_compact_differs(struct uci_delta_rec *r, const char *value)
+{
+	if ((r->cmd == UCI_CMD_REMOVE) || (r->cmd == UCI_CMD_LIST_ADD))
+		return true;
+	return !!strcmp(uci_compact_value(r), value);
+}
+
+/* the last change before r that is still tracked for the same option */
+static struct uci_delta_rec *uci_compact_valid(struct uci_delta_rec *r)
+{
+	for (; r; r = r->prev) {
+		if (r->opt_epoch != r->key->section->opt_epoch)
+			return NULL;
+		if (!r->dropped)
+			return r;
+	}
+	return NULL;
+}
+
+static void uci_compact_link(struct uci_delta_key *s, struct uci_delta_rec *r)
+{
+	r->epoch = s->epoch;
+	r->sprev = s->last;
+	s->last = r;
+}
+
+static void uci_compact_barrier(struct uci_delta_key *s)
+{
+	s->epoch++;
+	s->opt_epoch++;
+	s->last = NULL;
+}
+
+/*
+ * removing a section makes all changes to it since the last barrier
+ * irrelevant. if the section is known to have been missing before them,
+ * because they start with a removal or it was added as an anonymous
+ * section (whose name is unique), the removal itself can go as well
+ */
+static void uci_compact_remove_section(struct uci_compact *c, struct uci_delta_key *s, struct uci_delta_rec *r)
+{
+	struct uci_delta_rec *t, *first = NULL, *keep = r;
+	bool added = false;
+
+	for (t = s->last; t && (t->index > c->floor); t = t->sprev) {
+		if (t->dropped)
+			continue;
+		first = t;
+		if ((t->key == s) && (t->cmd == UCI_CMD_ADD))
+			added = true;
+	}
+
+	if (first && (first->key == s) && (first->cmd == UCI_CMD_REMOVE))
+		keep = first;
+	else if (added)
+		keep = NULL;
+
+	for (t = s->last; t && (t->index > c->floor); t = t->sprev) {
+		if (t != keep)
+			uci_compact_drop(c, t);
+	}
+	if (keep != r)
+		uci_compact_drop(c, r);
+
+	uci_compact_barrier(s);
+	if (keep)
+		uci_compact_link(s, keep);
+}
+
+/* unsetting an option makes all tracked changes to it irrelevant */
+static void uci_compact_erase_option(struct uci_compact *c, struct uci_delta_key *k, struct uci_delta_rec *r)
+{
+	struct uci_delta_rec *t;
+
+	for (t = uci_compact_valid(k->last); t; t = uci_compact_valid(t->prev)) {
+		if (uci_compact_erases(t))
+			break;
+		uci_compact_drop(c, t);
+	}
+
+	if (t) {
+		/* already unset */
+		uci_compact_drop(c, r);
+		k->last = t;
+		return;
+	}
+
+	r->prev = NULL;
+	k->last = r;
+	uci_compact_link(k->section, r);
+}
+
+/*
+ * setting an option replaces its value, and moves it to the end of the
+ * section unless the value stays the same. a previous change can only be
+ * dropped if the option is known to hold a different value without it,
+ * so that the new change still moves it.
+ */
+static void uci_compact_set_option(struct uci_compact *c, struct uci_delta_key *k, struct uci_delta_rec *r, const char *value)
+{
+	struct uci_delta_rec *t, *prev;
+
+	for (t = uci_compact_valid(k->last); t; t = prev) {
+		if (!uci_compact_erases(t) && (t->cmd != UCI_CMD_LIST_ADD) &&
+		    !strcmp(uci_compact_value(t), value)) {
+			/* does not change anything */
+			uci_compact_drop(c, r);
+			k->last = t;
+			return;
+		}
+
+		prev = uci_compact_valid(t->prev);
+		if (!prev || !uci_compact_differs(prev, value))
+			break;
+		uci_compact_drop(c, t);
+	}
+
+	r->prev = t;
+	k->last = r;
+	uci_compact_link(k->section, r);
+}
+
+static void uci_compact_line(struct uci_compact *c, struct uci_delta_rec *r, char *buf)
+{
+	struct uci_context *ctx = c->ctx;
+	struct uci_delta_key *s, *k;
+	struct uci_ptr ptr;
+	int cmd;
+
+	/* lines that do not parse are ignored when loading, keep them */
+	UCI_TRAP_SAVE(ctx, error);
+	cmd = uci_parse_delta_tuple(ctx, &buf, &ptr);
+	UCI_TRAP_RESTORE(ctx);
+
+	if (strcmp(ptr.package, c->package) != 0)
+		return;
+	if ((cmd != UCI_CMD_REMOVE) && !ptr.value)
+		return;
+
+	r->cmd = cmd;
+	if (cmd == UCI_CMD_REORDER) {
+		c->floor = r->index;
+		return;
+	}
+
+	/*
+	 * renaming onto an existing name leaves two entries with the same
+	 * name, changes to the new name are never dropped after that
+	 */
+	s = uci_compact_key(c, ptr.section, NULL);
+	if (cmd == UCI_CMD_RENAME) {
+		if (ptr.option) {
+			uci_compact_key(c, ptr.section, ptr.option)->last = NULL;
+			uci_compact_key(c, ptr.section, ptr.value)->last = NULL;
+			uci_compact_key(c, "", ptr.value)->untracked = true;
+			if (!s->untracked) {
+				r->key = s;
+				uci_compact_link(s, r);
+			}
+		} else {
+			uci_compact_barrier(s);
+			k = uci_compact_key(c, ptr.value, NULL);
+			uci_compact_barrier(k);
+			k->untracked = true;
+		}
+		return;
+	}
+	if (s->untracked)
+		return;
+
+	if (!ptr.option) {
+		r->key = s;
+		if (cmd == UCI_CMD_REMOVE) {
+			uci_compact_remove_section(c, s, r);
+		} else if (!ptr.value[0]) {
+			uci_compact_barrier(s);
+		} else {
+			/* the section may have been created */
+			s->opt_epoch++;
+			uci_compact_link(s, r);
+		}
+		return;
+	}
+
+	/* option names are tracked across sections, renaming sections moves them */
+	if (uci_compact_key(c, "", ptr.option)->untracked)
+		return;
+
+	k = uci_compact_key(c, ptr.section, ptr.option);
+	r->key = k;
+	r->opt_epoch = s->opt_epoch;
+	if (cmd == UCI_CMD_LIST_ADD) {
+		r->prev = k->last;
+		k->last = r;
+		uci_compact_link(s, r);
+	} else if (uci_compact_erases(r)) {
+		uci_compact_erase_option(c, k, r);
+	} else {
+		uci_compact_set_option(c, k, r, ptr.value);
+	}
+	return;
+
+error:
+	ctx->err = 0;
+}
+
+/* puts a change read from a binary delta file into the parse buffer as a text line */
+static void uci_delta_render(struct uci_context *ctx, struct uci_delta_in *in, const char *name)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	const char *value = (in->cmd == UCI_CMD_REMOVE) ? NULL : in->value;
+	size_t len;
+
+	len = strlen(name) + strlen(in->section) + 4;
+	if (in->option)
+		len += strlen(in->option) + 1;
+	if (value)
+		len += strlen(value) + 1;
+	if (len > (size_t) pctx->bufsz) {
+		pctx->bufsz = len;
+		pctx->buf = uci_realloc(ctx, pctx->buf, len);
+	}
+
+	sprintf(pctx->buf, "%s%s.%s%s%s%s%s", uci_delta_prefix(in->cmd), name, in->section,
+		in->option ? "." : "", in->option ? in->option : "",
+		value ? "=" : "", value ? value : "");
+}
+
+/* turns a rendered change back into a delta, the line is left alone */
+static void uci_delta_unrender(struct uci_context *ctx, struct uci_list *list, const char *line)
+{
+	struct uci_ptr ptr;
+	char *buf, *tmp;
+	int cmd;
+
+	buf = tmp = uci_strdup(ctx, line);
+	UCI_TRAP_SAVE(ctx, error);
+	cmd = uci_parse_delta_tuple(ctx, &tmp, &ptr);
+	uci_add_delta(ctx, list, cmd, ptr.section, ptr.option, ptr.value);
+	UCI_TRAP_RESTORE(ctx);
+	free(buf);
+	return;
+
+error:
+	free(buf);
+	/* changes that cannot be replayed are ignored when loading anyway */
+	if (ctx->err == UCI_ERR_MEM)
+		UCI_THROW(ctx, ctx->err);
+	ctx->err = 0;
+}
+
+/* compacts an open and locked delta file, returns the number of dropped changes */
+static int uci_compact_stream(struct uci_context *ctx, FILE *f, const char *name)
+{
+	struct uci_parse_context *pctx;
+	struct uci_element *e, *tmp;
+	struct uci_delta_rec *r;
+	struct uci_compact c;
+	struct uci_list lines, kept;
+	struct uci_delta_in in;
+	unsigned int index = 0;
+	bool binary;
+	int err = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.ctx = ctx;
+	c.package = name;
+	uci_list_init(&c.keys);
+	uci_list_init(&lines);
+	uci_list_init(&kept);
+	uci_delta_in_init(ctx, &in, f);
+
+	uci_cleanup(ctx);
+	uci_alloc_parse_context(ctx);
+	pctx = ctx->pctx;
+	pctx->file = f;
+	binary = uci_delta_is_binary(f);
+	rewind(f);
+
+	UCI_TRAP_SAVE(ctx, error);
+	while (!uci_input_eof(pctx)) {
+		if (binary) {
+			/* changes from binary files are compacted in their text form */
+			if (!uci_read_delta(&in))
+				break;
+			uci_delta_render(ctx, &in, name);
+		} else {
+			uci_getln(ctx, 0);
+		}
+		if (!pctx->buf[0])
+			continue;
+
+		/* NB: the line is modified while it is parsed */
+		e = uci_alloc_generic(ctx, UCI_TYPE_DELTA, pctx->buf, sizeof(struct uci_delta_rec));
+		uci_list_add(&lines, &e->list);
+		r = container_of(e, struct uci_delta_rec, e);
+		r->index = ++index;
+		uci_compact_line(&c, r, pctx->buf);
+	}
+
+	if (c.dropped) {
+		uci_foreach_element(&lines, e) {
+			if (!binary || container_of(e, struct uci_delta_rec, e)->dropped)
+				continue;
+			uci_delta_unrender(ctx, &kept, e->name);
+		}
+
+		rewind(f);
+		if (ftruncate(fileno(f), 0) < 0)
+			UCI_THROW(ctx, UCI_ERR_IO);
+		if (binary) {
+			uci_write_delta(ctx, f, name, &kept, true);
+		} else {
+			uci_foreach_element(&lines, e) {
+				if (!container_of(e, struct uci_delta_rec, e)->dropped)
+					fprintf(f, "%s\n", e->name);
+			}
+		}
+		if (fflush(f))
+			UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	UCI_TRAP_RESTORE(ctx);
+	goto done;
+
+error:
+	err = ctx->err;
+done:
+	uci_foreach_element_safe(&lines, tmp, e) {
+		uci_free_element(e);
+	}
+	uci_foreach_element_safe(&kept, tmp, e) {
+		uci_free_delta(uci_to_delta(e));
+	}
+	uci_delta_in_free(&in);
+	uci_foreach_element_safe(&c.keys, tmp, e) {
+		uci_free_element(e);
+	}
+	free(c.hash);
+	free(c.name);
+	uci_cleanup(ctx);
+	if (err)
+		UCI_THROW(ctx, err);
+	return c.dropped;
+}
+
+int uci_compact_delta(struct uci_context *ctx, struct uci_package *p)
+{
+	char *filename = NULL;
+	struct stat statbuf;
+	FILE *f = NULL;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+
+	if (!p->has_delta)
+		return 0;
+
+	if ((asprintf(&filename, "%s/%s", ctx->savedir, p->e.name) < 0) || !filename)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	UCI_TRAP_SAVE(ctx, done);
+	if (stat(filename, &statbuf) == 0) {
+		f = uci_open_stream(ctx, filename, SEEK_SET, true, false);
+		uci_compact_stream(ctx, f, p->e.name);
+	}
+	UCI_TRAP_RESTORE(ctx);
+
+done:
+	free(filename);
+	uci_close_stream(f);
+	if (ctx->err)
+		UCI_THROW(ctx, ctx->err);
+	return 0;
+}
+
+static void uci_filter_delta_binary(struct uci_context *ctx, FILE *f, const char *name, const char *section, const char *option)
+{
+	struct uci_element *e, *tmp;
+	struct uci_delta_in in;
+	struct uci_list list;
+	long pos, start = -1;
+	int err = 0;
+
+	uci_list_init(&list);
+	uci_delta_in_init(ctx, &in, f);
+
+	UCI_TRAP_SAVE(ctx, error);
+	for (pos = ftell(f); uci_read_delta(&in); pos = ftell(f)) {
+		if ((!section || !strcmp(section, in.section)) &&
+		    (!option || (in.option && !strcmp(option, in.option)))) {
+			if (start < 0)
+				start = pos;
+			continue;
+		}
+
+		/* changes before the first match stay where they are */
+		if (start >= 0)
+			uci_add_delta(ctx, &list, in.cmd, in.section, in.option, in.value);
+	}
+
+	/* the remaining changes go into a new block after the first match */
+	if (start >= 0) {
+		if ((fseek(f, start, SEEK_SET) < 0) ||
+		    (ftruncate(fileno(f), start) < 0))
+			UCI_THROW(ctx, UCI_ERR_IO);
+		if (!uci_list_empty(&list))
+			uci_write_delta(ctx, f, name, &list, true);
+	}
+	UCI_TRAP_RESTORE(ctx);
+	goto done;
+
+error:
+	err = ctx->err;
+done:
+	uci_foreach_element_safe(&list, tmp, e) {
+		uci_free_delta(uci_to_delta(e));
+	}
+	uci_delta_in_free(&in);
+	if (err)
+		UCI_THROW(ctx, err);
+}
+
 static void uci_filter_delta(struct uci_context *ctx, const char *name, const char *section, const char *option)
 {
 	struct uci_parse_context *pctx;
@@ -288,6 +1259,7 @@ static void uci_filter_delta(struct uci_context *ctx, const char *name, const ch
 	char *filename = NULL;
 	struct uci_ptr ptr;
 	FILE *f = NULL;
+	long pos = 0, start = -1;
 
 	uci_list_init(&list);
 	uci_alloc_parse_context(ctx);
@@ -299,20 +1271,30 @@ static void uci_filter_delta(struct uci_context *ctx, const char *name, const ch
 	UCI_TRAP_SAVE(ctx, done);
 	f = uci_open_stream(ctx, filename, SEEK_SET, true, false);
 	pctx->file = f;
-	while (!feof(f)) {
-		struct uci_element *e;
+	if (uci_delta_is_binary(f)) {
+		uci_filter_delta_binary(ctx, f, name, section, option);
+		goto filtered;
+	}
+	while (!uci_input_eof(pctx)) {
+		struct uci_element *e = NULL;
 		char *buf;
+		long len;
 
 		uci_getln(ctx, 0);
 		buf = pctx->buf;
+		len = strlen(buf) + 1;
+		pos += len;
 		if (!buf[0])
 			continue;
 
 		/* NB: need to allocate the element before the call to 
 		 * uci_parse_delta_tuple, otherwise the original string 
-		 * gets modified before it is saved */
-		e = uci_alloc_generic(ctx, UCI_TYPE_DELTA, pctx->buf, sizeof(struct uci_element));
-		uci_list_add(&list, &e->list);
+		 * gets modified before it is saved. lines before the
+		 * first match stay where they are and are not kept */
+		if (start >= 0) {
+			e = uci_alloc_generic(ctx, UCI_TYPE_DELTA, pctx->buf, sizeof(struct uci_element));
+			uci_list_add(&list, &e->list);
+		}
 
 		uci_parse_delta_tuple(ctx, &buf, &ptr);
 		if (section) {
@@ -324,17 +1306,23 @@ static void uci_filter_delta(struct uci_context *ctx, const char *name, const ch
 				continue;
 		}
 		/* match, drop this element again */
-		uci_free_element(e);
+		if (e)
+			uci_free_element(e);
+		else
+			start = pos - len;
 	}
 
-	/* rebuild the delta file */
-	rewind(f);
-	if (ftruncate(fileno(f), 0) < 0)
-		UCI_THROW(ctx, UCI_ERR_IO);
+	/* rebuild the delta file from the first dropped line on */
+	if (start >= 0) {
+		if ((fseek(f, start, SEEK_SET) < 0) ||
+		    (ftruncate(fileno(f), start) < 0))
+			UCI_THROW(ctx, UCI_ERR_IO);
+	}
 	uci_foreach_element_safe(&list, tmp, e) {
 		fprintf(f, "%s\n", e->name);
 		uci_free_element(e);
 	}
+filtered:
 	UCI_TRAP_RESTORE(ctx);
 
 done:
@@ -400,6 +1388,8 @@ int uci_save(struct uci_context *ctx, struct uci_package *p)
 	char *filename = NULL;
 	struct uci_element *e, *tmp;
 	struct stat statbuf;
+	bool binary;
+	long start;
 
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, p != NULL);
@@ -439,40 +1429,29 @@ int uci_save(struct uci_context *ctx, struct uci_package *p)
 	UCI_TRAP_SAVE(ctx, done);
 	f = uci_open_stream(ctx, filename, SEEK_END, true, true);
 	UCI_TRAP_RESTORE(ctx);
+	start = ftell(f);
 
-	uci_foreach_element_safe(&p->delta, tmp, e) {
-		struct uci_delta *h = uci_to_delta(e);
-		char *prefix = "";
+	/* an existing delta file keeps its format */
+	if (start > 0)
+		binary = uci_delta_is_binary(f);
+	else
+		binary = !!(ctx->flags & UCI_FLAG_BINARY_DELTA);
 
-		switch(h->cmd) {
-		case UCI_CMD_REMOVE:
-			prefix = "-";
-			break;
-		case UCI_CMD_RENAME:
-			prefix = "@";
-			break;
-		case UCI_CMD_ADD:
-			prefix = "+";
-			break;
-		case UCI_CMD_REORDER:
-			prefix = "^";
-			break;
-		case UCI_CMD_LIST_ADD:
-			prefix = "|";
-			break;
-		default:
-			break;
-		}
+	UCI_TRAP_SAVE(ctx, done);
+	uci_write_delta(ctx, f, p->e.name, &p->delta, binary);
+	UCI_TRAP_RESTORE(ctx);
 
-		fprintf(f, "%s%s.%s", prefix, p->e.name, h->section);
-		if (e->name)
-			fprintf(f, ".%s", e->name);
+	uci_foreach_element_safe(&p->delta, tmp, e) {
+		uci_free_delta(uci_to_delta(e));
+	}
 
-		if (h->cmd == UCI_CMD_REMOVE)
-			fprintf(f, "\n");
-		else
-			fprintf(f, "=%s\n", h->value);
-		uci_free_delta(h);
+	/* the changes are saved even if compacting them fails */
+	if (start / UCI_DELTA_COMPACT != ftell(f) / UCI_DELTA_COMPACT) {
+		UCI_TRAP_SAVE(ctx, compacted);
+		uci_compact_stream(ctx, f, p->e.name);
+		UCI_TRAP_RESTORE(ctx);
+compacted:
+		ctx->err = 0;
 	}
 
 done:
@@ -19,60 +19,359 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <glob.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "uci.h"
 #include "uci_internal.h"
 
 #define LINEBUF	32
-#define LINEBUF_MAX	4096
+#define LINEBUF_INIT	256
 
 /*
- * Fetch a new line from the input stream and resize buffer if necessary
+ * Map a config file into memory for parsing, if it is a regular file
+ * read from the start and it ends with a newline. The file size must not
+ * be a multiple of the page size: the rest of the last page is filled with
+ * zeroes, so a line continued at the end of the file still sees a
+ * terminating null byte.
  */
-__private void uci_getln(struct uci_context *ctx, int offset)
+static void uci_map_stream(struct uci_context *ctx)
 {
 	struct uci_parse_context *pctx = ctx->pctx;
-	char *p;
-	int ofs;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	char *map;
 
-	if (pctx->buf == NULL) {
-		pctx->buf = uci_malloc(ctx, LINEBUF);
-		pctx->bufsz = LINEBUF;
+	if (fstat(fileno(pctx->file), &st) < 0)
+		return;
+
+	if (!S_ISREG(st.st_mode) || (st.st_size <= 0) ||
+		(pagesize <= 0) || (st.st_size % pagesize == 0))
+		return;
+
+	if (ftell(pctx->file) != 0)
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(pctx->file), 0);
+	if (map == MAP_FAILED)
+		return;
+
+	if (map[st.st_size - 1] != '\n') {
+		munmap(map, st.st_size);
+		return;
 	}
 
-	ofs = offset;
+	pctx->map = map;
+	pctx->mapsz = st.st_size;
+	pctx->pos = map;
+}
+
+/*
+ * true once uci_getln has handed out every line of the input. lines that
+ * were read ahead for continuing the previous one are still returned after
+ * the stream ran into EOF
+ */
+__private bool uci_input_eof(struct uci_parse_context *pctx)
+{
+	if (pctx->map)
+		return (pctx->pos >= pctx->map + pctx->mapsz);
+
+	return feof(pctx->file) && (pctx->next >= pctx->len);
+}
+
+/*
+ * Terminate the next line of a mapped file. Lines are adjacent in memory,
+ * so a continuation line directly follows the null byte of the previous one
+ */
+static void uci_getln_map(struct uci_context *ctx, int offset)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	char *end = pctx->map + pctx->mapsz;
+	char *nl;
+
+	if (!offset)
+		pctx->buf = pctx->pos;
+
+	if (pctx->pos >= end)
+		return;
+
+	nl = memchr(pctx->pos, '\n', end - pctx->pos);
+	*nl = 0;
+	pctx->pos = nl + 1;
+	pctx->line++;
+}
+
+/*
+ * Append the next line of the input stream to the buffer, growing it as
+ * needed. Returns false if nothing could be read anymore
+ */
+static bool uci_readln(struct uci_context *ctx)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	int ofs = pctx->len;
+	char *p;
+
 	do {
-		p = &pctx->buf[ofs];
-		p[ofs] = 0;
+		if (pctx->bufsz - ofs < LINEBUF) {
+			pctx->bufsz *= 2;
+			pctx->buf = uci_realloc(ctx, pctx->buf, pctx->bufsz);
+		}
 
-		p = fgets(p, pctx->bufsz - ofs, pctx->file);
+		p = fgets(&pctx->buf[ofs], pctx->bufsz - ofs, pctx->file);
 		if (!p || !*p)
-			return;
+			break;
 
 		ofs += strlen(p);
 		if (pctx->buf[ofs - 1] == '\n') {
-			pctx->line++;
 			pctx->buf[ofs - 1] = 0;
-			return;
+			pctx->len = ofs;
+			pctx->eol = true;
+			return true;
 		}
+	} while (!feof(pctx->file));
 
-		if (pctx->bufsz > LINEBUF_MAX/2)
-			uci_parse_error(ctx, p, "line too long");
+	pctx->buf[ofs] = 0;
+	if (ofs == pctx->len)
+		return false;
 
+	/* keep a null byte after the last line for continuing it */
+	if (ofs + 2 > pctx->bufsz) {
 		pctx->bufsz *= 2;
 		pctx->buf = uci_realloc(ctx, pctx->buf, pctx->bufsz);
-	} while (1);
+	}
+	pctx->buf[ofs + 1] = 0;
+	pctx->len = ofs + 1;
+	pctx->eol = false;
+	return true;
+}
+
+/*
+ * Fetch a new line from the input stream. Lines ending with a backslash
+ * may be continued by the parser, so all of them are read ahead in one go
+ * and the parser can keep pointers into the buffer while it picks them up.
+ * offset is ignored, continuation lines always follow the previous line
+ */
+__private void uci_getln(struct uci_context *ctx, int offset)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	char *p;
+	int len;
+
+	if (pctx->map) {
+		uci_getln_map(ctx, offset);
+		return;
+	}
+
+	if (pctx->buf == NULL) {
+		pctx->buf = uci_malloc(ctx, LINEBUF_INIT);
+		pctx->bufsz = LINEBUF_INIT;
+	}
+
+	if (!offset) {
+		/* drop the lines that were already handed out */
+		pctx->len -= pctx->next;
+		memmove(pctx->buf, &pctx->buf[pctx->next], pctx->len);
+		pctx->next = 0;
+
+		if (!pctx->len && !uci_readln(ctx))
+			return;
+
+		/* read ahead until the last line does not end with a backslash */
+		while (pctx->eol && (pctx->len > 1) &&
+				(pctx->buf[pctx->len - 2] == '\\')) {
+			if (!uci_readln(ctx))
+				break;
+		}
+	}
+
+	p = &pctx->buf[pctx->next];
+	if (pctx->next >= pctx->len) {
+		/* nothing left, continued lines end here */
+		*p = 0;
+		return;
+	}
+
+	len = strlen(p) + 1;
+	pctx->next += len;
+	if ((pctx->next < pctx->len) || pctx->eol)
+		pctx->line++;
 }
 
 
+/*
+ * character classes of the tokenizer: the characters that end a run of
+ * plain characters in each parser state. whitespace matches isspace()
+ * in the C locale
+ */
+#define SCAN_SPACE	(1 << 0)
+#define SCAN_UNQUOTED	(1 << 1)
+#define SCAN_DQUOTE	(1 << 2)
+#define SCAN_SQUOTE	(1 << 3)
+
+static const unsigned char scan_class[256] = {
+	[0] = SCAN_UNQUOTED | SCAN_DQUOTE | SCAN_SQUOTE,
+	['\t' ... '\r'] = SCAN_SPACE | SCAN_UNQUOTED,
+	[' '] = SCAN_SPACE | SCAN_UNQUOTED,
+	['"'] = SCAN_UNQUOTED | SCAN_DQUOTE,
+	['#'] = SCAN_UNQUOTED,
+	['\''] = SCAN_UNQUOTED | SCAN_SQUOTE,
+	[';'] = SCAN_UNQUOTED,
+	['\\'] = SCAN_UNQUOTED | SCAN_DQUOTE,
+};
+
+static inline bool is_space(char c)
+{
+	return scan_class[(unsigned char) c] & SCAN_SPACE;
+}
+
+#if defined(__AVX2__)
+#define SCAN_VEC	32
+
+static inline uint64_t scan_vec(const char *s, int class)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *) s);
+	__m256i m = _mm256_cmpeq_epi8(x, _mm256_setzero_si256());
+	__m256i t;
+
+	switch (class) {
+	case SCAN_UNQUOTED:
+		t = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('#')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(';')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+		/* fall through */
+	case SCAN_DQUOTE:
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+		break;
+	case SCAN_SQUOTE:
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')));
+		break;
+	}
+	return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+#define scan_vec_pos(mask)	__builtin_ctzll(mask)
+
+#elif defined(__SSE2__)
+#define SCAN_VEC	16
+
+static inline uint64_t scan_vec(const char *s, int class)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *) s);
+	__m128i m = _mm_cmpeq_epi8(x, _mm_setzero_si128());
+	__m128i t;
+
+	switch (class) {
+	case SCAN_UNQUOTED:
+		t = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('#')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(';')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+		/* fall through */
+	case SCAN_DQUOTE:
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+		break;
+	case SCAN_SQUOTE:
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+		break;
+	}
+	return (uint32_t) _mm_movemask_epi8(m);
+}
+
+#define scan_vec_pos(mask)	__builtin_ctzll(mask)
+
+#elif defined(__ARM_NEON)
+#define SCAN_VEC	16
+
+static inline uint64_t scan_vec(const char *s, int class)
+{
+	uint8x16_t x = vld1q_u8((const uint8_t *) s);
+	uint8x16_t m = vceqq_u8(x, vdupq_n_u8(0));
+
+	switch (class) {
+	case SCAN_UNQUOTED:
+		m = vorrq_u8(m, vcleq_u8(vsubq_u8(x, vdupq_n_u8('\t')), vdupq_n_u8('\r' - '\t')));
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(' ')));
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('#')));
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(';')));
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('\'')));
+		/* fall through */
+	case SCAN_DQUOTE:
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('"')));
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('\\')));
+		break;
+	case SCAN_SQUOTE:
+		m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('\'')));
+		break;
+	}
+
+	/* narrow to 4 bits per byte */
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+#define scan_vec_pos(mask)	(__builtin_ctzll(mask) / 4)
+
+#endif
+
+/*
+ * find the next character of the given class, starting at s. Vector loads
+ * are only used where the whole block lies within the line buffer or the
+ * mapped file, the remaining bytes are checked one at a time.
+ */
+static inline char *scan_stop(struct uci_context *ctx, char *s, int class)
+{
+#ifdef SCAN_VEC
+	struct uci_parse_context *pctx = ctx->pctx;
+	const char *start, *end;
+	uint64_t mask;
+
+	if (pctx->map) {
+		start = pctx->map;
+		end = pctx->map + pctx->mapsz;
+	} else {
+		start = pctx->buf;
+		end = pctx->buf + pctx->bufsz;
+	}
+
+	if ((s >= start) && (s < end)) {
+		while (end - s >= SCAN_VEC) {
+			mask = scan_vec(s, class);
+			if (mask)
+				return s + scan_vec_pos(mask);
+			s += SCAN_VEC;
+		}
+	}
+#endif
+	while (!(scan_class[(unsigned char) *s] & class))
+		s++;
+
+	return s;
+}
+
 /*
  * parse a character escaped by '\'
  * returns true if the escaped character is to be parsed
@@ -101,7 +400,7 @@ static inline bool parse_backslash(struct uci_context *ctx, char **str)
 static void skip_whitespace(struct uci_context *ctx, char **str)
 {
 restart:
-	while (**str && isspace(**str))
+	while (is_space(**str))
 		*str += 1;
 
 	if (**str == '\\') {
@@ -112,11 +411,25 @@ restart:
 
 static inline void addc(char **dest, char **src)
 {
-	**dest = **src;
+	/* nothing to move until the first escape or quote was removed */
+	if (*dest != *src)
+		**dest = **src;
 	*dest += 1;
 	*src += 1;
 }
 
+/* add a run of plain characters, up to the next one of the given class */
+static inline void addrun(struct uci_context *ctx, char **dest, char **src, int class)
+{
+	char *end = scan_stop(ctx, *src, class);
+	int len = end - *src;
+
+	if (*dest != *src)
+		memmove(*dest, *src, len);
+	*dest += len;
+	*src = end;
+}
+
 /*
  * parse a double quoted string argument from the command line
  */
@@ -139,6 +452,7 @@ static void parse_double_quote(struct uci_context *ctx, char **str, char **targe
 			/* fall through */
 		default:
 			addc(target, str);
+			addrun(ctx, target, str, SCAN_DQUOTE);
 			break;
 		}
 	}
@@ -162,6 +476,7 @@ static void parse_single_quote(struct uci_context *ctx, char **str, char **targe
 			return;
 		default:
 			addc(target, str);
+			addrun(ctx, target, str, SCAN_SQUOTE);
 		}
 	}
 	uci_parse_error(ctx, *str, "unterminated '");
@@ -195,9 +510,10 @@ static void parse_str(struct uci_context *ctx, char **str, char **target)
 			/* fall through */
 		default:
 			addc(target, str);
+			addrun(ctx, target, str, SCAN_UNQUOTED);
 			break;
 		}
-	} while (**str && !isspace(**str));
+	} while (**str && !is_space(**str));
 done:
 
 	/* 
@@ -316,6 +632,21 @@ static void assert_eol(struct uci_context *ctx, char **str)
 		uci_parse_error(ctx, *str, "too many arguments");
 }
 
+/*
+ * skip the command word. All commands take at least one argument, so
+ * if the command ends the line of a mapped file (where the next line
+ * follows directly after the null byte), report the missing argument here
+ */
+static inline void skip_command(struct uci_context *ctx, char **str)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+
+	*str += strlen(*str);
+	if (pctx->map && (*str == pctx->pos - 1))
+		uci_parse_error(ctx, *str + 1, "insufficient arguments");
+	*str += 1;
+}
+
 /* 
  * switch to a different config, either triggered by uci_load, or by a
  * 'package <...>' statement in the import file
@@ -359,7 +690,7 @@ static void uci_parse_package(struct uci_context *ctx, char **str, bool single)
 	char *name = NULL;
 
 	/* command string null-terminated by strtok */
-	*str += strlen(*str) + 1;
+	skip_command(ctx, str);
 
 	name = next_arg(ctx, str, true, true);
 	assert_eol(ctx, str);
@@ -390,7 +721,7 @@ static void uci_parse_config(struct uci_context *ctx, char **str)
 	}
 
 	/* command string null-terminated by strtok */
-	*str += strlen(*str) + 1;
+	skip_command(ctx, str);
 
 	type = next_arg(ctx, str, true, false);
 	if (!uci_validate_type(type))
@@ -398,20 +729,29 @@ static void uci_parse_config(struct uci_context *ctx, char **str)
 	name = next_arg(ctx, str, false, true);
 	assert_eol(ctx, str);
 
+	pctx->lazy_section = NULL;
 	if (!name) {
 		ctx->internal = !pctx->merge;
 		UCI_NESTED(uci_add_section, ctx, pctx->package, type, &pctx->section);
 	} else {
 		uci_fill_ptr(ctx, &ptr, &pctx->package->e);
-		e = uci_lookup_list(&pctx->package->sections, name);
-		if (e)
+		e = uci_lookup_hash(&pctx->package->section_hash, &pctx->package->sections, name);
+		if (e) {
 			ptr.s = uci_to_section(e);
+			/* new options go after the ones that are already there */
+			uci_parse_lazy(ctx, ptr.s);
+		}
 		ptr.section = name;
 		ptr.value = type;
 
 		ctx->internal = !pctx->merge;
 		UCI_NESTED(uci_set, ctx, &ptr);
 		pctx->section = uci_to_section(ptr.last);
+
+		/* the name of an anonymous section depends on its options,
+		 * only the options of named ones can be parsed later */
+		if (pctx->lazy && !e && !pctx->section->anonymous)
+			pctx->lazy_section = pctx->section;
 	}
 }
 
@@ -430,14 +770,14 @@ static void uci_parse_option(struct uci_context *ctx, char **str, bool list)
 		uci_parse_error(ctx, *str, "option/list command found before the first section");
 
 	/* command string null-terminated by strtok */
-	*str += strlen(*str) + 1;
+	skip_command(ctx, str);
 
 	name = next_arg(ctx, str, true, true);
 	value = next_arg(ctx, str, false, false);
 	assert_eol(ctx, str);
 
 	uci_fill_ptr(ctx, &ptr, &pctx->section->e);
-	e = uci_lookup_list(&pctx->section->options, name);
+	e = uci_lookup_hash(&pctx->section->option_hash, &pctx->section->options, name);
 	if (e)
 		ptr.o = uci_to_option(e);
 	ptr.option = name;
@@ -502,112 +842,401 @@ invalid:
 	} while (1);
 }
 
-/* max number of characters that escaping adds to the string */
+/* replacement for a single quote inside a quoted string */
 #define UCI_QUOTE_ESCAPE	"'\\''"
 
+/* size of the output buffer of the exporter */
+#define EXPORTBUF	16384
+
 /*
- * escape an uci string for export
+ * the exporter collects its output in ctx->buf and hands it to the
+ * kernel in large blocks, bypassing the buffer of the stdio stream
  */
-static char *uci_escape(struct uci_context *ctx, const char *str)
-{
-	const char *end;
-	int ofs = 0;
+struct uci_export_ctx {
+	struct uci_context *ctx;
+	FILE *stream;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+};
 
-	if (!ctx->buf) {
-		ctx->bufsz = LINEBUF;
-		ctx->buf = malloc(LINEBUF);
+static void uci_export_flush(struct uci_export_ctx *out)
+{
+	size_t ofs = 0;
+	ssize_t ret;
+
+	if (out->fd < 0) {
+		/* no file descriptor, e.g. a memory stream */
+		if (fwrite(out->buf, 1, out->len, out->stream) != out->len)
+			UCI_THROW(out->ctx, UCI_ERR_IO);
+		out->len = 0;
+		return;
 	}
 
-	while (1) {
-		int len;
-
-		end = strchr(str, '\'');
-		if (!end)
-			end = str + strlen(str);
-		len = end - str;
-
-		/* make sure that we have enough room in the buffer */
-		while (ofs + len + sizeof(UCI_QUOTE_ESCAPE) + 1 > ctx->bufsz) {
-			ctx->bufsz *= 2;
-			ctx->buf = uci_realloc(ctx, ctx->buf, ctx->bufsz);
+	while (ofs < out->len) {
+		ret = write(out->fd, out->buf + ofs, out->len - ofs);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			UCI_THROW(out->ctx, UCI_ERR_IO);
 		}
+		ofs += ret;
+	}
+	out->len = 0;
+}
 
-		/* copy the string until the character before the quote */
-		memcpy(&ctx->buf[ofs], str, len);
-		ofs += len;
+static void uci_export_write(struct uci_export_ctx *out, const char *str, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (out->len == out->size)
+			uci_export_flush(out);
+
+		n = out->size - out->len;
+		if (n > len)
+			n = len;
+		memcpy(out->buf + out->len, str, n);
+		out->len += n;
+		str += n;
+		len -= n;
+	}
+}
 
-		/* end of string? return the buffer */
-		if (*end == 0)
-			break;
+#define uci_export_str(out, str) \
+	uci_export_write(out, str, sizeof(str) - 1)
 
-		memcpy(&ctx->buf[ofs], UCI_QUOTE_ESCAPE, sizeof(UCI_QUOTE_ESCAPE));
-		ofs += strlen(&ctx->buf[ofs]);
+/* write a string in single quotes, escaping the quotes inside of it */
+static void uci_export_quoted(struct uci_export_ctx *out, const char *str)
+{
+	size_t len = strlen(str);
+	const char *end;
+
+	uci_export_str(out, "'");
+	while ((end = memchr(str, '\'', len)) != NULL) {
+		uci_export_write(out, str, end - str);
+		uci_export_str(out, UCI_QUOTE_ESCAPE);
+		len -= end + 1 - str;
 		str = end + 1;
 	}
-
-	ctx->buf[ofs] = 0;
-	return ctx->buf;
+	uci_export_write(out, str, len);
+	uci_export_str(out, "'");
 }
 
 /*
  * export a single config package to a file stream
  */
-static void uci_export_package(struct uci_package *p, FILE *stream, bool header)
+static void uci_export_package(struct uci_package *p, struct uci_export_ctx *out, bool header)
 {
-	struct uci_context *ctx = p->ctx;
+	struct uci_context *ctx = out->ctx;
 	struct uci_element *s, *o, *i;
 
-	if (header)
-		fprintf(stream, "package '%s'\n", uci_escape(ctx, p->e.name));
+	if (header) {
+		uci_export_str(out, "package ");
+		uci_export_quoted(out, p->e.name);
+		uci_export_str(out, "\n");
+	}
 	uci_foreach_element(&p->sections, s) {
 		struct uci_section *sec = uci_to_section(s);
-		fprintf(stream, "\nconfig '%s'", uci_escape(ctx, sec->type));
-		if (!sec->anonymous || (ctx->flags & UCI_FLAG_EXPORT_NAME))
-			fprintf(stream, " '%s'", uci_escape(ctx, sec->e.name));
-		fprintf(stream, "\n");
+		uci_export_str(out, "\nconfig ");
+		uci_export_quoted(out, sec->type);
+		if (!sec->anonymous || (ctx->flags & UCI_FLAG_EXPORT_NAME)) {
+			uci_export_str(out, " ");
+			uci_export_quoted(out, sec->e.name);
+		}
+		uci_export_str(out, "\n");
 		uci_foreach_element(&sec->options, o) {
 			struct uci_option *opt = uci_to_option(o);
 			switch(opt->type) {
 			case UCI_TYPE_STRING:
-				fprintf(stream, "\toption '%s'", uci_escape(ctx, opt->e.name));
-				fprintf(stream, " '%s'\n", uci_escape(ctx, opt->v.string));
+				uci_export_str(out, "\toption ");
+				uci_export_quoted(out, opt->e.name);
+				uci_export_str(out, " ");
+				uci_export_quoted(out, opt->v.string);
+				uci_export_str(out, "\n");
 				break;
 			case UCI_TYPE_LIST:
 				uci_foreach_element(&opt->v.list, i) {
-					fprintf(stream, "\tlist '%s'", uci_escape(ctx, opt->e.name));
-					fprintf(stream, " '%s'\n", uci_escape(ctx, i->name));
+					uci_export_str(out, "\tlist ");
+					uci_export_quoted(out, opt->e.name);
+					uci_export_str(out, " ");
+					uci_export_quoted(out, i->name);
+					uci_export_str(out, "\n");
 				}
 				break;
 			default:
-				fprintf(stream, "\t# unknown type for option '%s'\n", uci_escape(ctx, opt->e.name));
+				uci_export_str(out, "\t# unknown type for option ");
+				uci_export_quoted(out, opt->e.name);
+				uci_export_str(out, "\n");
 				break;
 			}
 		}
 	}
-	fprintf(stream, "\n");
+	uci_export_str(out, "\n");
 }
 
 int uci_export(struct uci_context *ctx, FILE *stream, struct uci_package *package, bool header)
 {
 	struct uci_element *e;
 
+	struct uci_export_ctx out;
+
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, stream != NULL);
 
+	/* options that were not parsed yet are needed now */
+	if (package) {
+		uci_parse_lazy_package(ctx, package);
+	} else {
+		uci_foreach_element(&ctx->root, e) {
+			uci_parse_lazy_package(ctx, uci_to_package(e));
+		}
+	}
+
+	if (ctx->bufsz < EXPORTBUF) {
+		ctx->buf = uci_realloc(ctx, ctx->buf, EXPORTBUF);
+		ctx->bufsz = EXPORTBUF;
+	}
+
+	/* whatever the stream has buffered goes first */
+	if (fflush(stream) != 0)
+		UCI_THROW(ctx, UCI_ERR_IO);
+
+	out.ctx = ctx;
+	out.stream = stream;
+	out.fd = fileno(stream);
+	out.buf = ctx->buf;
+	out.size = ctx->bufsz;
+	out.len = 0;
+
 	if (package)
-		uci_export_package(package, stream, header);
+		uci_export_package(package, &out, header);
 	else {
 		uci_foreach_element(&ctx->root, e) {
-			uci_export_package(uci_to_package(e), stream, header);
+			uci_export_package(uci_to_package(e), &out, header);
 		}
 	}
+	uci_export_flush(&out);
 
 	return 0;
 }
 
+/*
+ * in a lazy import, the option lines of a named section are skipped and
+ * only the range of the file that they cover is recorded. lines that the
+ * skipped range could not be parsed from in isolation, i.e. those that are
+ * continued or hold several commands, make the section parsed right away.
+ * returns false if the line has to be parsed now
+ */
+static bool uci_lazy_line(struct uci_context *ctx)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	struct uci_section *s = pctx->lazy_section;
+	char *str = pctx->buf;
+	bool space = true;
+	char quote = 0;
+	int words = 0;
+	int len;
+
+	/* words are split like in uci_parse_line */
+	str += strspn(str, " \t");
+	if (!*str || (*str == '#'))
+		goto skip;
+
+	len = strcspn(str, " \t");
+	if (((len == 1) && (*str == 'c')) ||
+	    ((len == 6) && !strncmp(str, "config", 6)))
+		return false;
+
+	if (!str[len] ||
+	    !(((len == 1) && ((*str == 'o') || (*str == 'l'))) ||
+	      ((len == 6) && !strncmp(str, "option", 6)) ||
+	      ((len == 4) && !strncmp(str, "list", 4))))
+		goto parse;
+
+	/*
+	 * only a plain option name followed by one value is deferred, so that
+	 * anything that could fail to parse is still reported by the load
+	 */
+	for (str += len; *str; str++) {
+		if (quote) {
+			if (*str == quote)
+				quote = 0;
+			else if ((*str == '\\') && (quote == '"') && !*++str)
+				goto parse;
+			continue;
+		}
+		if ((*str == ' ') || (*str == '\t')) {
+			space = true;
+			continue;
+		}
+		if (space && (++words > 2))
+			goto parse;
+		space = false;
+		if ((words == 1) && !isalnum((unsigned char) *str) && (*str != '_'))
+			goto parse;
+		if ((*str == '\'') || (*str == '"')) {
+			quote = *str;
+		} else if (*str == '\\') {
+			if (!*++str)
+				goto parse;
+		} else if (*str == ';') {
+			goto parse;
+		}
+	}
+	if (quote || (words != 2))
+		goto parse;
+
+	if (!s->lazy) {
+		s->lazy = pctx->buf;
+		s->lazy_line = pctx->line - 1;
+	}
+
+skip:
+	/* keep the line intact for parsing it later */
+	if (s->lazy)
+		s->lazy_len = pctx->pos - s->lazy;
+	pctx->pos[-1] = '\n';
+	return true;
+
+parse:
+	uci_parse_lazy(ctx, s);
+	pctx->lazy_section = NULL;
+	return false;
+}
+
+/* the mapped file is dropped once the last section is done with it */
+static void uci_lazy_put(struct uci_package *p)
+{
+	if (p->lazy && !--p->lazy->pending) {
+		uci_lazy_free(p->lazy);
+		p->lazy = NULL;
+	}
+}
+
+/* parse the option lines of a section that were skipped by a lazy import */
+__private void uci_parse_lazy(struct uci_context *ctx, struct uci_section *s)
+{
+	struct uci_parse_context *prev = ctx->pctx, *pctx;
+	struct uci_arena *a = s->package->arena;
+	bool open = a && a->open;
+	int err = 0;
+
+	if (!s->lazy)
+		return;
+
+	pctx = uci_malloc(ctx, sizeof(struct uci_parse_context));
+	pctx->map = pctx->pos = s->lazy;
+	pctx->mapsz = s->lazy_len;
+	pctx->line = s->lazy_line;
+	pctx->section = s;
+	ctx->pctx = pctx;
+
+	/* adding the options looks the section up again */
+	s->lazy = NULL;
+
+	/* the options belong to the package data like the section itself */
+	if (a)
+		a->open = true;
+
+	UCI_TRAP_SAVE(ctx, done);
+	UCI_TRAP_LOOP(ctx, error);
+	while (!uci_input_eof(pctx)) {
+		uci_getln(ctx, 0);
+		if (pctx->buf[0])
+			uci_parse_line(ctx, true);
+		continue;
+error:
+		if (ctx->flags & UCI_FLAG_PERROR)
+			uci_perror(ctx, NULL);
+		if ((ctx->err != UCI_ERR_PARSE) ||
+			(ctx->flags & UCI_FLAG_STRICT))
+			UCI_TRAP_RETHROW(ctx);
+	}
+	UCI_TRAP_RESTORE(ctx);
+	ctx->err = 0;
+	UCI_TRAP_RESTORE(ctx);
+
+done:
+	err = ctx->err;
+	if (a)
+		a->open = open;
+	uci_lazy_put(s->package);
+
+	/* the map belongs to the package, the error position is kept for
+	 * uci_perror if no other parser is active */
+	pctx->map = NULL;
+	pctx->buf = NULL;
+	if (err && !prev) {
+		pctx->section = NULL;
+	} else {
+		free(pctx);
+		ctx->pctx = prev;
+	}
+	if (err)
+		UCI_THROW(ctx, err);
+}
+
+__private void uci_parse_lazy_package(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *e;
+
+	if (!p->lazy)
+		return;
+
+	uci_foreach_element(&p->sections, e) {
+		uci_parse_lazy(ctx, uci_to_section(e));
+	}
+}
+
+/* forget the option lines of a section that is removed */
+__private void uci_lazy_drop(struct uci_section *s)
+{
+	if (!s->lazy)
+		return;
+
+	s->lazy = NULL;
+	uci_lazy_put(s->package);
+}
+
+__private void uci_lazy_free(struct uci_lazy *lazy)
+{
+	if (!lazy)
+		return;
+
+	munmap(lazy->map, lazy->size);
+	free(lazy);
+}
+
+/* hand the mapped file over to the package, if any of its sections still need it */
+static void uci_lazy_finish(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_parse_context *pctx = ctx->pctx;
+	struct uci_element *e;
+	unsigned int pending = 0;
+
+	uci_foreach_element(&p->sections, e) {
+		if (uci_to_section(e)->lazy)
+			pending++;
+	}
+	if (!pending)
+		return;
+
+	p->lazy = uci_malloc(ctx, sizeof(struct uci_lazy));
+	p->lazy->map = pctx->map;
+	p->lazy->size = pctx->mapsz;
+	p->lazy->pending = pending;
+	pctx->map = NULL;
+	pctx->buf = NULL;
+}
+
 int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct uci_package **package, bool single)
 {
+	/* NB: UCI_INTERNAL use means the caller finishes loading the package */
+	bool internal = ctx->internal;
 	struct uci_parse_context *pctx;
+	struct uci_element *e;
 	UCI_HANDLE_ERR(ctx);
 
 	/* make sure no memory from previous parse attempts is leaked */
@@ -616,11 +1245,22 @@ int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct u
 	uci_alloc_parse_context(ctx);
 	pctx = ctx->pctx;
 	pctx->file = stream;
+
+	/* config files of the file backend are parsed straight from memory */
+	if (internal)
+		uci_map_stream(ctx);
+
 	if (*package && single) {
 		pctx->package = *package;
 		pctx->merge = true;
 	}
 
+	/* lazy parsing needs the file to stay mapped, and compiled copies
+	 * of the config file need all of it parsed */
+	if (pctx->map && single && !pctx->merge && (ctx->flags & UCI_FLAG_LAZY) &&
+	    !(ctx->flags & (UCI_FLAG_CACHE | UCI_FLAG_READONLY)))
+		pctx->lazy = true;
+
 	/*
 	 * If 'name' was supplied, assume that the supplied stream does not contain
 	 * the appropriate 'package <name>' string to specify the config name
@@ -631,24 +1271,26 @@ int uci_import(struct uci_context *ctx, FILE *stream, const char *name, struct u
 		pctx->name = name;
 	}
 
-	while (!feof(pctx->file)) {
+	UCI_TRAP_LOOP(ctx, error);
+	while (!uci_input_eof(pctx)) {
 		uci_getln(ctx, 0);
-		UCI_TRAP_SAVE(ctx, error);
-		if (pctx->buf[0])
+		if (!(pctx->lazy_section && uci_lazy_line(ctx)) && pctx->buf[0])
 			uci_parse_line(ctx, single);
-		UCI_TRAP_RESTORE(ctx);
 		continue;
 error:
 		if (ctx->flags & UCI_FLAG_PERROR)
 			uci_perror(ctx, NULL);
 		if ((ctx->err != UCI_ERR_PARSE) ||
 			(ctx->flags & UCI_FLAG_STRICT))
-			UCI_THROW(ctx, ctx->err);
+			UCI_TRAP_RETHROW(ctx);
 	}
+	UCI_TRAP_RESTORE(ctx);
 
 	uci_fixup_section(ctx, ctx->pctx->section);
 	if (!pctx->package && name)
 		uci_switch_config(ctx);
+	if (pctx->lazy && pctx->package)
+		uci_lazy_finish(ctx, pctx->package);
 	if (package)
 		*package = pctx->package;
 	if (pctx->merge)
@@ -660,6 +1302,13 @@ error:
 	/* no error happened, we can get rid of the parser context now */
 	uci_cleanup(ctx);
 
+	if (!internal) {
+		uci_foreach_element(&ctx->root, e)
+			uci_seal_package(uci_to_package(e));
+		if (package)
+			uci_seal_package(*package);
+	}
+
 	return 0;
 }
 
@@ -675,69 +1324,423 @@ static char *uci_config_path(struct uci_context *ctx, const char *name)
 	return filename;
 }
 
-static void uci_file_commit(struct uci_context *ctx, struct uci_package **package, bool overwrite)
+/*
+ * identity of the files a package was loaded from, used by uci_reload
+ * to find out whether anything needs to be parsed again
+ */
+struct uci_file_stat {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+struct uci_file_state {
+	int n_files;
+	struct uci_file_stat files[];
+};
+
+static void uci_file_stat(struct uci_file_stat *fs, const char *dir, const char *name)
+{
+	char *filename = NULL;
+	struct stat st;
+
+	/* missing files are recorded as all zero */
+	memset(fs, 0, sizeof(*fs));
+	if (dir && ((asprintf(&filename, "%s/%s", dir, name) < 0) || !filename))
+		return;
+
+	if (stat(filename ? filename : name, &st) == 0) {
+		fs->dev = st.st_dev;
+		fs->ino = st.st_ino;
+		fs->size = st.st_size;
+		fs->mtime = st.st_mtim;
+	}
+	free(filename);
+}
+
+/* returns NULL if out of memory, the package is then always reloaded */
+static struct uci_file_state *
+uci_file_state(struct uci_context *ctx, const char *filename, const char *name, bool delta)
+{
+	struct uci_file_state *state;
+	struct uci_element *e;
+	int n = 1;
+
+	if (delta) {
+		uci_foreach_element(&ctx->delta_path, e)
+			n++;
+		n++;
+	}
+
+	state = malloc(sizeof(*state) + n * sizeof(struct uci_file_stat));
+	if (!state)
+		return NULL;
+
+	state->n_files = n;
+	uci_file_stat(&state->files[0], NULL, filename);
+	if (delta) {
+		n = 1;
+		uci_foreach_element(&ctx->delta_path, e)
+			uci_file_stat(&state->files[n++], e->name, name);
+		uci_file_stat(&state->files[n], ctx->savedir, name);
+	}
+
+	return state;
+}
+
+/* check for changes in delta files, a view of the package cannot take them */
+static bool uci_file_pending(struct uci_file_state *state)
+{
+	int i;
+
+	if (!state)
+		return true;
+
+	for (i = 1; i < state->n_files; i++) {
+		if (state->files[i].size > 0)
+			return true;
+	}
+	return false;
+}
+
+static bool uci_file_changed(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_file_state *old = p->priv;
+	struct uci_file_state *cur;
+	bool changed = true;
+
+	if (!old || !p->path)
+		return true;
+
+	cur = uci_file_state(ctx, p->path, p->e.name, p->has_delta);
+	if (cur && (cur->n_files == old->n_files))
+		changed = !!memcmp(cur->files, old->files, cur->n_files * sizeof(struct uci_file_stat));
+	free(cur);
+
+	return changed;
+}
+
+static void uci_file_unload(struct uci_context *ctx, struct uci_package *p)
+{
+	free(p->priv);
+	p->priv = NULL;
+}
+
+/* make a rename in a directory durable, now or on the next uci_sync */
+static void uci_file_sync_dir(struct uci_context *ctx, const char *dir)
+{
+	struct uci_element *e;
+	int fd;
+
+	if (ctx->flags & UCI_FLAG_SYNC_BATCH) {
+		if (!uci_lookup_list(&ctx->sync_dirs, dir)) {
+			e = uci_alloc_generic(ctx, UCI_TYPE_PATH, dir, sizeof(struct uci_element));
+			uci_list_add(&ctx->sync_dirs, &e->list);
+		}
+		return;
+	}
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		UCI_THROW(ctx, UCI_ERR_IO);
+	if (fsync(fd) < 0) {
+		close(fd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	close(fd);
+}
+
+/*
+ * one package being committed. commits go through these in phases, so that
+ * several packages can be written before the first one is published
+ */
+struct uci_file_txn {
+	struct uci_package **package;
+	struct uci_package *p;
+	FILE *f;	/* the locked config file */
+	FILE *delta;	/* the locked delta file, cleared once f is written */
+	FILE *out;	/* temporary file that replaces f */
+	char *tmp;
+	char *dir;
+	bool write;
+};
+
+static int uci_file_txn_cmp(const void *a, const void *b)
 {
-	struct uci_package *p = *package;
-	FILE *f = NULL;
+	const struct uci_file_txn *ta = a, *tb = b;
+
+	return strcmp(ta->p->path, tb->p->path);
+}
+
+/* merge the changes of other processes and the delta into the package */
+static void uci_file_txn_flush(struct uci_context *ctx, struct uci_file_txn *txn, bool overwrite)
+{
+	struct uci_package *p = txn->p;
 	char *name = NULL;
 	char *path = NULL;
 
-	if (!p->path) {
-		if (overwrite)
-			p->path = uci_config_path(ctx, p->e.name);
-		else
-			UCI_THROW(ctx, UCI_ERR_INVAL);
+	txn->write = true;
+	if (!p->has_delta)
+		return;
+
+	UCI_TRAP_SAVE(ctx, error);
+	if (!overwrite) {
+		name = uci_strdup(ctx, p->e.name);
+		path = uci_strdup(ctx, p->path);
+		/* dump our own changes to the delta file */
+		if (!uci_list_empty(&p->delta))
+			UCI_INTERNAL(uci_save, ctx, p);
+
+		/* 
+		 * other processes might have modified the config 
+		 * as well. dump and reload 
+		 */
+		uci_free_package(&p);
+		txn->p = NULL;
+		uci_cleanup(ctx);
+		UCI_INTERNAL(uci_import, ctx, txn->f, name, &p, true);
+
+		p->path = path;
+		p->has_delta = true;
+		txn->p = p;
+
+		/* freed together with the uci_package */
+		path = NULL;
 	}
 
-	/* open the config file for writing now, so that it is locked */
-	f = uci_open_stream(ctx, p->path, SEEK_SET, true, true);
+	uci_seal_package(p);
+	txn->write = (uci_load_delta(ctx, p, &txn->delta) > 0);
+	UCI_TRAP_RESTORE(ctx);
+	free(name);
+	return;
 
-	/* flush unsaved changes and reload from delta file */
-	UCI_TRAP_SAVE(ctx, done);
-	if (p->has_delta) {
-		if (!overwrite) {
-			name = uci_strdup(ctx, p->e.name);
-			path = uci_strdup(ctx, p->path);
-			/* dump our own changes to the delta file */
-			if (!uci_list_empty(&p->delta))
-				UCI_INTERNAL(uci_save, ctx, p);
-
-			/* 
-			 * other processes might have modified the config 
-			 * as well. dump and reload 
-			 */
-			uci_free_package(&p);
-			uci_cleanup(ctx);
-			UCI_INTERNAL(uci_import, ctx, f, name, &p, true);
-
-			p->path = path;
-			p->has_delta = true;
-			*package = p;
-
-			/* freed together with the uci_package */
-			path = NULL;
+error:
+	free(name);
+	free(path);
+	UCI_THROW(ctx, ctx->err);
+}
+
+/*
+ * write the package to a temporary file next to its config file, which
+ * is later renamed over the config file, so that the config file is never
+ * seen partially written, not even after a crash. if the config file cannot
+ * be replaced that way, this fails when @strict is set and otherwise leaves
+ * txn->out unset, so that the config file is rewritten in place.
+ */
+static void uci_file_txn_write(struct uci_context *ctx, struct uci_file_txn *txn, bool strict)
+{
+	struct uci_package *p = txn->p;
+	const char *base;
+	struct stat st;
+	int fd;
+
+	if (!txn->write)
+		return;
+
+	/* renaming would replace the link instead of its target */
+	if ((lstat(p->path, &st) < 0) || !S_ISREG(st.st_mode)) {
+		if (strict)
+			UCI_THROW(ctx, UCI_ERR_IO);
+		return;
+	}
+
+	base = strrchr(p->path, '/');
+	if (base) {
+		if ((asprintf(&txn->dir, "%.*s", (int) (base - p->path), p->path) < 0) || !txn->dir) {
+			txn->dir = NULL;
+			UCI_THROW(ctx, UCI_ERR_MEM);
 		}
+		base++;
+	} else {
+		txn->dir = uci_strdup(ctx, ".");
+		base = p->path;
+	}
 
-		/* flush delta */
-		if (!uci_load_delta(ctx, p, true))
-			goto done;
+	if ((asprintf(&txn->tmp, "%s/.%s.XXXXXX", txn->dir, base) < 0) || !txn->tmp) {
+		txn->tmp = NULL;
+		UCI_THROW(ctx, UCI_ERR_MEM);
 	}
 
-	rewind(f);
-	if (ftruncate(fileno(f), 0) < 0)
+	fd = mkstemp(txn->tmp);
+	if (fd < 0) {
+		free(txn->tmp);
+		txn->tmp = NULL;
+		/* the file itself may still be writable */
+		if (!strict && ((errno == EACCES) || (errno == EPERM)))
+			return;
 		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+
+	txn->out = fdopen(fd, "w");
+	if (!txn->out) {
+		close(fd);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+
+	/* keep owner and permissions of the config file */
+	if ((fstat(fileno(txn->f), &st) < 0) ||
+	    ((geteuid() == 0) && (fchown(fd, st.st_uid, st.st_gid) < 0)) ||
+	    (fchmod(fd, st.st_mode & 07777) < 0))
+		UCI_THROW(ctx, UCI_ERR_IO);
+
+	UCI_INTERNAL(uci_export, ctx, txn->out, p, false);
+}
+
+/* make the temporary file durable before it is published */
+static void uci_file_txn_sync(struct uci_context *ctx, struct uci_file_txn *txn)
+{
+	FILE *out = txn->out;
+
+	if (!out)
+		return;
+
+	txn->out = NULL;
+	if ((ctx->flags & UCI_FLAG_SYNC) && (fdatasync(fileno(out)) < 0)) {
+		fclose(out);
+		UCI_THROW(ctx, UCI_ERR_IO);
+	}
+	if (fclose(out))
+		UCI_THROW(ctx, UCI_ERR_IO);
+}
+
+static void uci_file_txn_publish(struct uci_context *ctx, struct uci_file_txn *txn)
+{
+	struct uci_package *p = txn->p;
+	FILE *delta;
+
+	if (!txn->write)
+		goto done;
+
+	if (txn->tmp) {
+		if (rename(txn->tmp, p->path) < 0)
+			UCI_THROW(ctx, UCI_ERR_IO);
+		free(txn->tmp);
+		txn->tmp = NULL;
+		if (ctx->flags & UCI_FLAG_SYNC)
+			uci_file_sync_dir(ctx, txn->dir);
+	} else {
+		rewind(txn->f);
+		if (ftruncate(fileno(txn->f), 0) < 0)
+			UCI_THROW(ctx, UCI_ERR_IO);
 
-	uci_export(ctx, f, p, false);
+		UCI_INTERNAL(uci_export, ctx, txn->f, p, false);
+		if ((ctx->flags & UCI_FLAG_SYNC) && (fdatasync(fileno(txn->f)) < 0))
+			UCI_THROW(ctx, UCI_ERR_IO);
+	}
+
+	if (txn->delta) {
+		delta = txn->delta;
+		txn->delta = NULL;
+		uci_flush_delta(ctx, delta);
+	}
+
+done:
+	/* the package now matches what is on disk */
+	free(p->priv);
+	p->priv = uci_file_state(ctx, p->path, p->e.name, p->has_delta);
+	if (p->has_delta)
+		uci_cache_remove(ctx, p->e.name);
+}
+
+static void uci_file_txn_close(struct uci_file_txn *txn)
+{
+	if (txn->out)
+		fclose(txn->out);
+	if (txn->tmp) {
+		unlink(txn->tmp);
+		free(txn->tmp);
+	}
+	free(txn->dir);
+	uci_close_stream(txn->delta);
+	uci_close_stream(txn->f);
+	*txn->package = txn->p;
+}
+
+/*
+ * all config files are locked in the order of their path, and each phase is
+ * run over all packages before the next one starts. with @strict set, every
+ * package is written to a temporary file first, so an error before the
+ * publish phase leaves all config files and deltas untouched. the files are
+ * still renamed one after another though: if publishing fails half way,
+ * the packages published before stay committed.
+ */
+static void uci_file_commit_txn(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite, bool strict)
+{
+	struct uci_file_txn *txn;
+	enum uci_flags flags = ctx->flags;
+	bool atomic = strict || (flags & UCI_FLAG_ATOMIC_COMMIT);
+	int err = 0;
+	int i;
+
+	txn = uci_malloc(ctx, n * sizeof(*txn));
+	for (i = 0; i < n; i++) {
+		txn[i].package = &packages[i];
+		txn[i].p = packages[i];
+	}
+
+	UCI_TRAP_SAVE(ctx, error);
+	for (i = 0; i < n; i++) {
+		struct uci_package *p = txn[i].p;
+
+		if (!p->path) {
+			if (overwrite)
+				p->path = uci_config_path(ctx, p->e.name);
+			else
+				UCI_THROW(ctx, UCI_ERR_INVAL);
+		}
+	}
+
+	qsort(txn, n, sizeof(*txn), uci_file_txn_cmp);
+	for (i = 1; i < n; i++) {
+		if (!strcmp(txn[i - 1].p->path, txn[i].p->path))
+			UCI_THROW(ctx, UCI_ERR_DUPLICATE);
+	}
+
+	/* open the config files for writing now, so that they are locked */
+	for (i = 0; i < n; i++)
+		txn[i].f = uci_open_stream(ctx, txn[i].p->path, SEEK_SET, true, true);
+
+	/* flush unsaved changes and reload from delta file */
+	for (i = 0; i < n; i++)
+		uci_file_txn_flush(ctx, &txn[i], overwrite);
+
+	if (atomic) {
+		for (i = 0; i < n; i++)
+			uci_file_txn_write(ctx, &txn[i], strict);
+		for (i = 0; i < n; i++)
+			uci_file_txn_sync(ctx, &txn[i]);
+	}
+
+	/* directories shared by several packages only need one sync */
+	if (n > 1)
+		ctx->flags |= UCI_FLAG_SYNC_BATCH;
+	for (i = 0; i < n; i++)
+		uci_file_txn_publish(ctx, &txn[i]);
 	UCI_TRAP_RESTORE(ctx);
+	goto done;
 
+error:
+	err = ctx->err;
 done:
-	if (name)
-		free(name);
-	if (path)
-		free(path);
-	uci_close_stream(f);
-	if (ctx->err)
-		UCI_THROW(ctx, ctx->err);
+	ctx->flags = flags;
+	for (i = 0; i < n; i++)
+		uci_file_txn_close(&txn[i]);
+	free(txn);
+	if (!(flags & UCI_FLAG_SYNC_BATCH) && !uci_sync_dirs(ctx) && !err)
+		err = UCI_ERR_IO;
+	if (err)
+		UCI_THROW(ctx, err);
+}
+
+static void uci_file_commit(struct uci_context *ctx, struct uci_package **package, bool overwrite)
+{
+	uci_file_commit_txn(ctx, package, 1, overwrite, false);
+}
+
+static void uci_file_commit_many(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite)
+{
+	uci_file_commit_txn(ctx, packages, n, overwrite, true);
 }
 
 
@@ -805,11 +1808,12 @@ static char **uci_list_config_files(struct uci_context *ctx)
 	return configs;
 }
 
-static struct uci_package *uci_file_load(struct uci_context *ctx, const char *name)
+static struct uci_package *uci_file_load_from(struct uci_context *ctx, const char *name, bool daemon)
 {
+	struct uci_file_state *state = NULL;
 	struct uci_package *package = NULL;
 	char *filename;
-	bool confdir;
+	bool confdir, view;
 	FILE *file = NULL;
 
 	switch (name[0]) {
@@ -834,24 +1838,68 @@ static struct uci_package *uci_file_load(struct uci_context *ctx, const char *na
 	file = uci_open_stream(ctx, filename, SEEK_SET, false, false);
 	ctx->err = 0;
 	UCI_TRAP_SAVE(ctx, done);
-	UCI_INTERNAL(uci_import, ctx, file, name, &package, true);
+	/* the stream is locked, the file cannot change before it is parsed */
+	state = uci_file_state(ctx, filename, name, confdir);
+	view = confdir && (ctx->flags & UCI_FLAG_READONLY) && !uci_file_pending(state);
+	if (confdir && daemon)
+		package = view ? uci_cache_view(ctx, file, name, true) :
+			uci_cache_load(ctx, file, name, true);
+	if (!package && view)
+		package = uci_cache_view(ctx, file, name, false);
+	if (!package && confdir && (ctx->flags & UCI_FLAG_CACHE))
+		package = uci_cache_load(ctx, file, name, false);
+	if (!package) {
+		UCI_INTERNAL(uci_import, ctx, file, name, &package, true);
+		if (package && confdir && (ctx->flags & (UCI_FLAG_CACHE | UCI_FLAG_READONLY)))
+			uci_cache_save(ctx, file, package);
+	}
 	UCI_TRAP_RESTORE(ctx);
 
 	if (package) {
 		package->path = filename;
 		package->has_delta = confdir;
-		uci_load_delta(ctx, package, false);
+		package->priv = state;
+		state = NULL;
+		uci_load_delta(ctx, package, NULL);
 	}
 
 done:
+	free(state);
 	uci_close_stream(file);
 	if (ctx->err)
 		UCI_THROW(ctx, ctx->err);
 	return package;
 }
 
+static struct uci_package *uci_file_load(struct uci_context *ctx, const char *name)
+{
+	return uci_file_load_from(ctx, name, false);
+}
+
+/*
+ * the daemon backend builds packages from the snapshots published by ucid
+ * instead of parsing the config files, everything else is left to the file
+ * backend. it falls back to parsing whenever there is no current snapshot
+ */
+static struct uci_package *uci_daemon_load(struct uci_context *ctx, const char *name)
+{
+	return uci_file_load_from(ctx, name, true);
+}
+
 __private UCI_BACKEND(uci_file_backend, "file",
 	.load = uci_file_load,
 	.commit = uci_file_commit,
+	.commit_many = uci_file_commit_many,
+	.changed = uci_file_changed,
+	.unload = uci_file_unload,
+	.list_configs = uci_list_config_files,
+);
+
+__private UCI_BACKEND(uci_daemon_backend, "ucid",
+	.load = uci_daemon_load,
+	.commit = uci_file_commit,
+	.commit_many = uci_file_commit_many,
+	.changed = uci_file_changed,
+	.unload = uci_file_unload,
 	.list_configs = uci_list_config_files,
 );
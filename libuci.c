@@ -18,12 +18,17 @@
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <dlfcn.h>
 #include <glob.h>
+#include <pthread.h>
 #include "uci.h"
 
 static const char *uci_errstr[] = {
@@ -35,6 +40,7 @@ static const char *uci_errstr[] = {
 	[UCI_ERR_PARSE] =     "Parse error",
 	[UCI_ERR_DUPLICATE] = "Duplicate entry",
 	[UCI_ERR_UNKNOWN] =   "Unknown error",
+	[UCI_ERR_READONLY] =  "Package is read-only",
 };
 
 static void uci_unload_plugin(struct uci_context *ctx, struct uci_plugin *p);
@@ -42,6 +48,33 @@ static void uci_unload_plugin(struct uci_context *ctx, struct uci_plugin *p);
 #include "uci_internal.h"
 #include "list.c"
 
+/*
+ * every context links its own copies of the builtin backends, so that
+ * contexts used by different threads share no list nodes
+ */
+static struct uci_backend *uci_builtin_backend(struct uci_context *ctx, const struct uci_backend *b)
+{
+	struct uci_backend *copy;
+
+	copy = malloc(sizeof(struct uci_backend));
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, b, sizeof(struct uci_backend));
+	uci_list_add(&ctx->backends, &copy->e.list);
+	return copy;
+}
+
+static void uci_free_backends(struct uci_context *ctx)
+{
+	struct uci_element *e, *tmp;
+
+	uci_foreach_element_safe(&ctx->backends, tmp, e) {
+		uci_list_del(&e->list);
+		free(uci_to_backend(e));
+	}
+}
+
 __private const char *uci_confdir = UCI_CONFDIR;
 __private const char *uci_savedir = UCI_SAVEDIR;
 
@@ -60,13 +93,18 @@ struct uci_context *uci_alloc_context(void)
 	uci_list_init(&ctx->backends);
 	uci_list_init(&ctx->hooks);
 	uci_list_init(&ctx->plugins);
+	uci_list_init(&ctx->sync_dirs);
 	ctx->flags = UCI_FLAG_STRICT | UCI_FLAG_SAVED_DELTA;
 
 	ctx->confdir = (char *) uci_confdir;
 	ctx->savedir = (char *) uci_savedir;
 
-	uci_list_add(&ctx->backends, &uci_file_backend.e.list);
-	ctx->backend = &uci_file_backend;
+	ctx->backend = uci_builtin_backend(ctx, &uci_file_backend);
+	if (!ctx->backend || !uci_builtin_backend(ctx, &uci_daemon_backend)) {
+		uci_free_backends(ctx);
+		free(ctx);
+		return NULL;
+	}
 
 	return ctx;
 }
@@ -81,6 +119,7 @@ void uci_free_context(struct uci_context *ctx)
 		free(ctx->savedir);
 
 	uci_cleanup(ctx);
+	uci_sync_dirs(ctx);
 	UCI_TRAP_SAVE(ctx, ignore);
 	uci_foreach_element_safe(&ctx->root, tmp, e) {
 		struct uci_package *p = uci_to_package(e);
@@ -90,9 +129,12 @@ void uci_free_context(struct uci_context *ctx)
 		uci_free_element(e);
 	}
 	UCI_TRAP_RESTORE(ctx);
+	uci_intern_free(ctx->intern);
+	ctx->intern = NULL;
 	uci_foreach_element_safe(&ctx->root, tmp, e) {
 		uci_unload_plugin(ctx, uci_to_plugin(e));
 	}
+	uci_free_backends(ctx);
 	free(ctx);
 
 ignore:
@@ -131,7 +173,9 @@ __private void uci_cleanup(struct uci_context *ctx)
 	if (pctx->package)
 		uci_free_package(&pctx->package);
 
-	if (pctx->buf)
+	if (pctx->map)
+		munmap(pctx->map, pctx->mapsz);
+	else if (pctx->buf)
 		free(pctx->buf);
 
 	free(pctx);
@@ -146,7 +190,7 @@ uci_perror(struct uci_context *ctx, const char *str)
 void
 uci_get_errorstr(struct uci_context *ctx, char **dest, const char *prefix)
 {
-	static char error_info[128];
+	char error_info[128];
 	int err;
 	const char *format =
 		"%s%s" /* prefix */
@@ -213,25 +257,237 @@ int uci_commit(struct uci_context *ctx, struct uci_package **package, bool overw
 	return 0;
 }
 
-int uci_load(struct uci_context *ctx, const char *name, struct uci_package **package)
+int uci_commit_many(struct uci_context *ctx, struct uci_package **packages, int n, bool overwrite)
 {
-	struct uci_package *p;
-	struct uci_element *e;
+	struct uci_backend *b;
+	int i;
 
 	UCI_HANDLE_ERR(ctx);
-	UCI_ASSERT(ctx, ctx->backend && ctx->backend->load);
-	p = ctx->backend->load(ctx, name);
+	UCI_ASSERT(ctx, packages != NULL);
+	UCI_ASSERT(ctx, n > 0);
+	UCI_ASSERT(ctx, packages[0] != NULL);
+	b = packages[0]->backend;
+	UCI_ASSERT(ctx, b && b->commit);
+	for (i = 0; i < n; i++) {
+		UCI_ASSERT(ctx, packages[i] != NULL);
+		UCI_ASSERT(ctx, packages[i]->backend == b);
+	}
+
+	if (b->commit_many) {
+		b->commit_many(ctx, packages, n, overwrite);
+		return 0;
+	}
+
+	/* backends without support commit one package after another */
+	for (i = 0; i < n; i++)
+		b->commit(ctx, &packages[i], overwrite);
+	return 0;
+}
+
+/* fsync the directories of batched commits, keeps going after errors */
+__private bool uci_sync_dirs(struct uci_context *ctx)
+{
+	struct uci_element *e, *tmp;
+	bool ok = true;
+	int fd;
+
+	uci_foreach_element_safe(&ctx->sync_dirs, tmp, e) {
+		fd = open(e->name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || fsync(fd) < 0)
+			ok = false;
+		if (fd >= 0)
+			close(fd);
+		uci_free_element(e);
+	}
+	return ok;
+}
+
+int uci_sync(struct uci_context *ctx)
+{
+	UCI_HANDLE_ERR(ctx);
+	if (!uci_sync_dirs(ctx))
+		UCI_THROW(ctx, UCI_ERR_IO);
+	return 0;
+}
+
+static void uci_load_hooks(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *e;
+
 	uci_foreach_element(&ctx->hooks, e) {
 		struct uci_hook *h = uci_to_hook(e);
 		if (h->ops->load)
 			h->ops->load(h->ops, p);
 	}
+}
+
+int uci_load(struct uci_context *ctx, const char *name, struct uci_package **package)
+{
+	struct uci_package *p;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, ctx->backend && ctx->backend->load);
+	p = ctx->backend->load(ctx, name);
+	uci_seal_package(p);
+	if (ctx->flags & UCI_FLAG_READONLY)
+		p->readonly = true;
+	uci_load_hooks(ctx, p);
 	if (package)
 		*package = p;
 
 	return 0;
 }
 
+/* uci_load_many loads packages in at most this many threads */
+#define UCI_LOAD_THREADS	8
+
+struct uci_load_item
+{
+	struct uci_package *p;
+	int err;
+};
+
+struct uci_load_job
+{
+	char **names;
+	struct uci_load_item *items;
+	int n;
+	int next;
+};
+
+struct uci_load_worker
+{
+	struct uci_load_job *job;
+	struct uci_context *ctx;
+	pthread_t thread;
+};
+
+static void *uci_load_thread(void *arg)
+{
+	struct uci_load_worker *w = arg;
+	struct uci_load_job *job = w->job;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+		if (!job->items[i].p)
+			job->items[i].err = uci_load(w->ctx, job->names[i], &job->items[i].p);
+	}
+
+	return NULL;
+}
+
+/* a context with the settings of @ctx, for loading packages in another thread */
+static struct uci_context *uci_load_context(struct uci_context *ctx)
+{
+	struct uci_context *w;
+	struct uci_element *e;
+
+	w = uci_alloc_context();
+	if (!w)
+		return NULL;
+
+	w->flags = ctx->flags;
+	if ((uci_set_backend(w, ctx->backend->e.name) != UCI_OK) ||
+		(uci_set_confdir(w, ctx->confdir) != UCI_OK) ||
+		(uci_set_savedir(w, ctx->savedir) != UCI_OK))
+		goto error;
+
+	uci_foreach_element(&ctx->delta_path, e) {
+		if (uci_add_delta_path(w, e->name) != UCI_OK)
+			goto error;
+	}
+
+	return w;
+
+error:
+	uci_free_context(w);
+	return NULL;
+}
+
+int uci_load_many(struct uci_context *ctx, char **names, int n, struct uci_package **packages)
+{
+	struct uci_load_worker workers[UCI_LOAD_THREADS];
+	struct uci_load_job job;
+	struct uci_element *e;
+	volatile int i, err = 0;
+	int nw = 0;
+	long cpus;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, (names != NULL) || !n);
+	UCI_ASSERT(ctx, ctx->backend && ctx->backend->load);
+	if (n <= 0)
+		return 0;
+
+	memset(&job, 0, sizeof(job));
+	job.names = names;
+	job.n = n;
+	job.items = uci_malloc(ctx, n * sizeof(struct uci_load_item));
+	for (i = 0; i < n; i++) {
+		e = uci_lookup_list(&ctx->root, names[i]);
+		if (e)
+			job.items[i].p = uci_to_package(e);
+	}
+
+	/* parse errors that are only printed must come out in order */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((cpus > 1) && (n > 1) && !(ctx->flags & UCI_FLAG_PERROR)) {
+		while ((nw < cpus) && (nw < n) && (nw < UCI_LOAD_THREADS)) {
+			workers[nw].job = &job;
+			workers[nw].ctx = uci_load_context(ctx);
+			if (!workers[nw].ctx)
+				break;
+			if (pthread_create(&workers[nw].thread, NULL, uci_load_thread, &workers[nw])) {
+				uci_free_context(workers[nw].ctx);
+				break;
+			}
+			nw++;
+		}
+	}
+
+	for (i = 0; i < nw; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* without workers, the packages are loaded here one after another */
+	UCI_TRAP_LOOP(ctx, error);
+	for (i = 0; i < n; i++) {
+		struct uci_package *p = job.items[i].p;
+
+		if (!nw && !p) {
+			UCI_NESTED(uci_load, ctx, names[i], &job.items[i].p);
+		} else if (!p) {
+			UCI_THROW(ctx, job.items[i].err);
+		} else if (p->ctx != ctx) {
+			/* a name may be given twice, the first package is kept */
+			e = uci_lookup_list(&ctx->root, p->e.name);
+			if (e) {
+				job.items[i].p = uci_to_package(e);
+			} else {
+				uci_adopt_package(ctx, p);
+				uci_load_hooks(ctx, p);
+			}
+		}
+		continue;
+error:
+		job.items[i].p = NULL;
+		if (!err)
+			err = ctx->err;
+	}
+	UCI_TRAP_RESTORE(ctx);
+
+	for (i = 0; i < nw; i++)
+		uci_free_context(workers[i].ctx);
+
+	for (i = 0; packages && (i < n); i++)
+		packages[i] = job.items[i].p;
+	free(job.items);
+
+	if (err)
+		UCI_THROW(ctx, err);
+
+	return 0;
+}
+
 #ifdef UCI_PLUGIN_SUPPORT
 
 __plugin int uci_add_backend(struct uci_context *ctx, struct uci_backend *b)
@@ -243,8 +499,9 @@ __plugin int uci_add_backend(struct uci_context *ctx, struct uci_backend *b)
 	if (e)
 		UCI_THROW(ctx, UCI_ERR_DUPLICATE);
 
+	/* only copy the members that every plugin defines */
 	e = uci_malloc(ctx, sizeof(struct uci_backend));
-	memcpy(e, b, sizeof(struct uci_backend));
+	memcpy(e, b, offsetof(struct uci_backend, commit_many));
 
 	uci_list_add(&ctx->backends, &e->list);
 	return 0;
@@ -27,10 +27,400 @@ static void uci_list_set_pos(struct uci_list *head, struct uci_list *ptr, int po
 	uci_list_add(new_head->next, ptr);
 }
 
-static inline void uci_list_fixup(struct uci_list *ptr)
+/* Based on an efficient hash function published by D. J. Bernstein */
+static unsigned int djbhash(unsigned int hash, const char *str)
+{
+	int len = strlen(str);
+	int i;
+
+	/* initial value */
+	if (hash == ~0)
+		hash = 5381;
+
+	for(i = 0; i < len; i++) {
+		hash = ((hash << 5) + hash) + str[i];
+	}
+	return (hash & 0x7FFFFFFF);
+}
+
+/* lists shorter than this are searched linearly */
+#define UCI_HASH_MIN	16
+
+static inline unsigned int uci_hash_slot(struct uci_hash *h, const char *name)
+{
+	return djbhash(~0, name) & (h->size - 1);
+}
+
+static void uci_hash_insert(struct uci_hash *h, struct uci_element *e)
+{
+	unsigned int i = uci_hash_slot(h, e->name);
+
+	while (h->slots[i])
+		i = (i + 1) & (h->size - 1);
+	h->slots[i] = e;
+	h->used++;
+}
+
+/*
+ * build a lookup table for all named elements of a list, keeping the
+ * load factor below 1/2. returns NULL if the allocation fails, in which
+ * case lookups simply fall back to scanning the list.
+ */
+static struct uci_hash *uci_hash_build(struct uci_list *list)
+{
+	struct uci_element *e;
+	struct uci_hash *h;
+	unsigned int size = UCI_HASH_MIN * 2;
+	unsigned int count = 0;
+
+	uci_foreach_element(list, e)
+		count++;
+
+	while (size < count * 2)
+		size *= 2;
+
+	h = calloc(1, sizeof(struct uci_hash) + size * sizeof(struct uci_element *));
+	if (!h)
+		return NULL;
+
+	h->size = size;
+	uci_foreach_element(list, e) {
+		if (e->name)
+			uci_hash_insert(h, e);
+	}
+	return h;
+}
+
+/* add an element that has already been linked into the list */
+__private void
+uci_hash_add(struct uci_hash **hp, struct uci_list *list, struct uci_element *e)
+{
+	struct uci_hash *h = *hp;
+
+	if (!h || !e->name)
+		return;
+
+	if ((h->used + 1) * 2 > h->size) {
+		*hp = uci_hash_build(list);
+		free(h);
+		return;
+	}
+	uci_hash_insert(h, e);
+}
+
+/* remove an element (by identity) before it is renamed or freed */
+static void uci_hash_del(struct uci_hash *h, struct uci_element *e)
+{
+	unsigned int mask, i, j, k;
+
+	if (!h || !e->name)
+		return;
+
+	mask = h->size - 1;
+	i = uci_hash_slot(h, e->name);
+	while (h->slots[i] != e) {
+		if (!h->slots[i])
+			return;
+		i = (i + 1) & mask;
+	}
+	h->slots[i] = NULL;
+	h->used--;
+
+	/* move entries of the same cluster into the gap, if their home
+	 * slot does not lie cyclically between the gap and their position */
+	for (j = (i + 1) & mask; h->slots[j]; j = (j + 1) & mask) {
+		k = uci_hash_slot(h, h->slots[j]->name);
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+
+		h->slots[i] = h->slots[j];
+		h->slots[j] = NULL;
+		i = j;
+	}
+}
+
+#define UCI_INTERN_MIN	64
+
+static char **uci_intern_slot(struct uci_intern *t, const char *str)
+{
+	unsigned int i = djbhash(~0, str) & (t->size - 1);
+
+	while (t->slots[i] && strcmp(t->slots[i], str) != 0)
+		i = (i + 1) & (t->size - 1);
+	return &t->slots[i];
+}
+
+static void uci_intern_grow(struct uci_context *ctx, struct uci_intern *t)
+{
+	unsigned int size = t->size ? t->size * 2 : UCI_INTERN_MIN;
+	char **old = t->slots;
+	int i, n = t->size;
+
+	t->slots = uci_malloc(ctx, size * sizeof(char *));
+	t->size = size;
+	for (i = 0; i < n; i++) {
+		if (old[i])
+			*uci_intern_slot(t, old[i]) = old[i];
+	}
+	free(old);
+}
+
+/* returns the shared copy of a string, adding it to the table if necessary */
+__private char *uci_intern(struct uci_context *ctx, const char *str)
+{
+	struct uci_intern *t;
+	char **slot;
+
+	if (!ctx->intern)
+		ctx->intern = uci_malloc(ctx, sizeof(struct uci_intern));
+
+	t = ctx->intern;
+	if (!t->strings)
+		t->strings = uci_arena_new(ctx);
+	if ((t->used + 1) * 2 > t->size)
+		uci_intern_grow(ctx, t);
+
+	slot = uci_intern_slot(t, str);
+	if (!*slot) {
+		*slot = uci_arena_strdup(ctx, t->strings, str);
+		t->used++;
+	}
+	return *slot;
+}
+
+/* returns NULL if no section type or option name matches the string */
+__private char *uci_intern_lookup(struct uci_context *ctx, const char *str)
+{
+	if (!ctx->intern || !ctx->intern->size)
+		return NULL;
+
+	return *uci_intern_slot(ctx->intern, str);
+}
+
+__private void uci_intern_free(struct uci_intern *t)
+{
+	if (!t)
+		return;
+
+	uci_arena_free(t->strings);
+	free(t->slots);
+	free(t);
+}
+
+static void uci_type_index_free(struct uci_package *p)
+{
+	struct uci_type_index *ti = p->type_index;
+	int i;
+
+	if (!ti)
+		return;
+
+	for (i = 0; i < ti->n_types; i++)
+		free(ti->types[i].s);
+
+	free(ti->types);
+	free(ti);
+	p->type_index = NULL;
+}
+
+static struct uci_type_entry *
+uci_type_index_find(struct uci_type_index *ti, const char *type)
+{
+	int i;
+
+	if (!type)
+		return &ti->types[0];
+
+	for (i = 1; i < ti->n_types; i++) {
+		if (ti->types[i].type == type)
+			return &ti->types[i];
+	}
+	return NULL;
+}
+
+static struct uci_type_entry *
+uci_type_index_get(struct uci_type_index *ti, const char *type)
+{
+	struct uci_type_entry *t;
+
+	t = uci_type_index_find(ti, type);
+	if (t)
+		return t;
+
+	if (ti->n_types == ti->size) {
+		t = realloc(ti->types, (ti->size * 2) * sizeof(struct uci_type_entry));
+		if (!t)
+			return NULL;
+		ti->types = t;
+		ti->size *= 2;
+	}
+
+	t = &ti->types[ti->n_types];
+	memset(t, 0, sizeof(struct uci_type_entry));
+	t->type = type;
+	ti->n_types++;
+	return t;
+}
+
+static bool uci_type_entry_insert(struct uci_type_entry *t, struct uci_section *s, unsigned int pos)
+{
+	struct uci_section **tmp;
+
+	if (t->n == t->size) {
+		tmp = realloc(t->s, (t->size ? t->size * 2 : 8) * sizeof(struct uci_section *));
+		if (!tmp)
+			return false;
+		t->s = tmp;
+		t->size = (t->size ? t->size * 2 : 8);
+	}
+
+	if (pos > t->n)
+		pos = t->n;
+	memmove(&t->s[pos + 1], &t->s[pos], (t->n - pos) * sizeof(struct uci_section *));
+	t->s[pos] = s;
+	t->n++;
+	return true;
+}
+
+static void uci_type_entry_remove(struct uci_type_entry *t, struct uci_section *s)
+{
+	int i;
+
+	/* recently added sections are the most likely to go away again */
+	for (i = t->n - 1; i >= 0; i--) {
+		if (t->s[i] != s)
+			continue;
+
+		t->n--;
+		memmove(&t->s[i], &t->s[i + 1], (t->n - i) * sizeof(struct uci_section *));
+		return;
+	}
+}
+
+/* rebuild the list of all sections and the entry of a single type */
+static bool uci_type_index_sync(struct uci_package *p, const char *type)
+{
+	struct uci_type_index *ti = p->type_index;
+	struct uci_type_entry *all, *t;
+	struct uci_element *e;
+	int i;
+
+	all = &ti->types[0];
+	all->n = 0;
+	uci_foreach_element(&p->sections, e) {
+		if (!uci_type_entry_insert(all, uci_to_section(e), all->n))
+			return false;
+	}
+
+	if (!type)
+		return true;
+
+	t = uci_type_index_get(ti, type);
+	if (!t)
+		return false;
+
+	t->n = 0;
+	for (i = 0; i < all->n; i++) {
+		if (all->s[i]->type != type)
+			continue;
+		if (!uci_type_entry_insert(t, all->s[i], t->n))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * build the type index of a package, it is only created on the first
+ * extended lookup and then kept up to date by the functions below.
+ * If any allocation fails, the index is dropped and lookups fall back
+ * to walking the section list.
+ */
+static void uci_type_index_build(struct uci_package *p)
+{
+	struct uci_type_index *ti;
+	struct uci_type_entry *t;
+	struct uci_element *e;
+
+	ti = calloc(1, sizeof(struct uci_type_index));
+	if (!ti)
+		return;
+
+	p->type_index = ti;
+	ti->types = calloc(4, sizeof(struct uci_type_entry));
+	if (!ti->types)
+		goto error;
+
+	/* the entry of all sections is only counted once it exists */
+	ti->size = 4;
+	ti->n_types = 1;
+
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		t = uci_type_index_get(ti, s->type);
+		if (!t || !uci_type_entry_insert(t, s, t->n))
+			goto error;
+
+		t = &ti->types[0];
+		if (!uci_type_entry_insert(t, s, t->n))
+			goto error;
+	}
+	return;
+
+error:
+	uci_type_index_free(p);
+}
+
+/* a new section was appended to the package */
+static void uci_type_index_add(struct uci_package *p, struct uci_section *s)
+{
+	struct uci_type_entry *t;
+
+	if (!p->type_index)
+		return;
+
+	t = uci_type_index_get(p->type_index, s->type);
+	if (!t || !uci_type_entry_insert(t, s, t->n))
+		goto error;
+
+	t = &p->type_index->types[0];
+	if (!uci_type_entry_insert(t, s, t->n))
+		goto error;
+	return;
+
+error:
+	uci_type_index_free(p);
+}
+
+static void uci_type_index_del(struct uci_package *p, struct uci_section *s)
+{
+	struct uci_type_entry *t;
+
+	if (!p->type_index)
+		return;
+
+	t = uci_type_index_find(p->type_index, s->type);
+	if (t)
+		uci_type_entry_remove(t, s);
+	uci_type_entry_remove(&p->type_index->types[0], s);
+}
+
+/* a section was moved or got a different type */
+static void uci_type_index_update(struct uci_package *p, struct uci_section *s, const char *oldtype)
 {
-	ptr->prev->next = ptr;
-	ptr->next->prev = ptr;
+	struct uci_type_entry *t;
+
+	if (!p->type_index)
+		return;
+
+	if (oldtype && (oldtype != s->type)) {
+		t = uci_type_index_find(p->type_index, oldtype);
+		if (t)
+			uci_type_entry_remove(t, s);
+	}
+
+	if (!uci_type_index_sync(p, s->type))
+		uci_type_index_free(p);
 }
 
 /* 
@@ -48,18 +438,14 @@ uci_alloc_generic(struct uci_context *ctx, int type, const char *name, int size)
 	e = (struct uci_element *) ptr;
 	e->type = type;
 	if (name) {
-		UCI_TRAP_SAVE(ctx, error);
-		e->name = uci_strdup(ctx, name);
-		UCI_TRAP_RESTORE(ctx);
+		e->name = strdup(name);
+		if (!e->name) {
+			free(ptr);
+			UCI_THROW(ctx, UCI_ERR_MEM);
+		}
 	}
 	uci_list_init(&e->list);
-	goto done;
-
-error:
-	free(ptr);
-	UCI_THROW(ctx, ctx->err);
 
-done:
 	return e;
 }
 
@@ -73,19 +459,77 @@ uci_free_element(struct uci_element *e)
 	free(e);
 }
 
+/*
+ * package data is taken from the arena of the package while it is being
+ * loaded, and from the heap once the package has been sealed
+ */
+static char *uci_pkg_strdup(struct uci_package *p, const char *str)
+{
+	struct uci_arena *a = p->arena;
+
+	if (a && a->open)
+		return uci_arena_strdup(p->ctx, a, str);
+
+	if (a)
+		a->heap = true;
+	return uci_strdup(p->ctx, str);
+}
+
+static void uci_pkg_free(struct uci_package *p, void *ptr)
+{
+	if (p->arena && uci_arena_owns(p->arena, ptr))
+		return;
+
+	free(ptr);
+}
+
+static struct uci_element *
+uci_alloc_pkg_generic(struct uci_package *p, int type, const char *name, int size)
+{
+	struct uci_element *e;
+
+	if (!p->arena || !p->arena->open) {
+		if (p->arena)
+			p->arena->heap = true;
+		return uci_alloc_generic(p->ctx, type, name, size);
+	}
+
+	e = uci_arena_malloc(p->ctx, p->arena, size);
+	e->type = type;
+	if (name)
+		e->name = uci_arena_strdup(p->ctx, p->arena, name);
+	uci_list_init(&e->list);
+
+	return e;
+}
+
+static void uci_free_pkg_element(struct uci_package *p, struct uci_element *e)
+{
+	if (e->name)
+		uci_pkg_free(p, e->name);
+	if (!uci_list_empty(&e->list))
+		uci_list_del(&e->list);
+	uci_pkg_free(p, e);
+}
+
+#define uci_alloc_pkg_element(p, type, name, datasize) \
+	uci_to_ ## type (uci_alloc_pkg_generic(p, uci_type_ ## type, name, sizeof(struct uci_ ## type) + datasize))
+
 static struct uci_option *
 uci_alloc_option(struct uci_section *s, const char *name, const char *value)
 {
 	struct uci_package *p = s->package;
-	struct uci_context *ctx = p->ctx;
 	struct uci_option *o;
 
-	o = uci_alloc_element(ctx, option, name, strlen(value) + 1);
+	name = uci_intern(p->ctx, name);
+	o = uci_alloc_pkg_element(p, option, NULL, strlen(value) + 1);
+	o->e.name = (char *) name;
 	o->type = UCI_TYPE_STRING;
 	o->v.string = uci_dataptr(o);
 	o->section = s;
 	strcpy(o->v.string, value);
 	uci_list_add(&s->options, &o->e.list);
+	uci_hash_add(&s->option_hash, &s->options, &o->e);
 
 	return o;
 }
@@ -93,57 +537,46 @@ uci_alloc_option(struct uci_section *s, const char *name, const char *value)
 static inline void
 uci_free_option(struct uci_option *o)
 {
+	struct uci_package *p = o->section->package;
 	struct uci_element *e, *tmp;
 
+	uci_hash_del(o->section->option_hash, &o->e);
 	switch(o->type) {
 	case UCI_TYPE_STRING:
 		if ((o->v.string != uci_dataptr(o)) &&
 			(o->v.string != NULL))
-			free(o->v.string);
+			uci_pkg_free(p, o->v.string);
 		break;
 	case UCI_TYPE_LIST:
 		uci_foreach_element_safe(&o->v.list, tmp, e) {
-			uci_free_element(e);
+			uci_free_pkg_element(p, e);
 		}
 		break;
 	default:
 		break;
 	}
-	uci_free_element(&o->e);
+	o->e.name = NULL;
+	uci_free_pkg_element(p, &o->e);
 }
 
 static struct uci_option *
 uci_alloc_list(struct uci_section *s, const char *name)
 {
 	struct uci_package *p = s->package;
-	struct uci_context *ctx = p->ctx;
 	struct uci_option *o;
 
-	o = uci_alloc_element(ctx, option, name, 0);
+	name = uci_intern(p->ctx, name);
+	o = uci_alloc_pkg_element(p, option, NULL, 0);
+	o->e.name = (char *) name;
 	o->type = UCI_TYPE_LIST;
 	o->section = s;
 	uci_list_init(&o->v.list);
 	uci_list_add(&s->options, &o->e.list);
+	uci_hash_add(&s->option_hash, &s->options, &o->e);
 
 	return o;
 }
 
-/* Based on an efficient hash function published by D. J. Bernstein */
-static unsigned int djbhash(unsigned int hash, char *str)
-{
-	int len = strlen(str);
-	int i;
-
-	/* initial value */
-	if (hash == ~0)
-		hash = 5381;
-
-	for(i = 0; i < len; i++) {
-		hash = ((hash << 5) + hash) + str[i];
-	}
-	return (hash & 0x7FFFFFFF);
-}
-
 /* fix up an unnamed section, e.g. after adding options to it */
 __private void uci_fixup_section(struct uci_context *ctx, struct uci_section *s)
 {
@@ -162,6 +595,10 @@ __private void uci_fixup_section(struct uci_context *ctx, struct uci_section *s)
 	 * pairs of its option, and it is prefixed by a counter value.
 	 * If the order of the unnamed sections changes for some reason,
 	 * updates to them will be rejected.
+	 * The counter is not stored anywhere, it is recounted on load and
+	 * may end up lower than before, e.g. after an added and removed
+	 * section was compacted out of the delta. Names that are still in
+	 * use are skipped, so that the new section never takes one over.
 	 */
 	hash = djbhash(hash, s->type);
 	uci_foreach_element(&s->options, e) {
@@ -176,29 +613,33 @@ __private void uci_fixup_section(struct uci_context *ctx, struct uci_section *s)
 			break;
 		}
 	}
-	sprintf(buf, "cfg%02x%04x", ++s->package->n_section, hash % (1 << 16));
-	s->e.name = uci_strdup(ctx, buf);
+	do {
+		sprintf(buf, "cfg%02x%04x", ++s->package->n_section, hash % (1 << 16));
+	} while (uci_lookup_hash(&s->package->section_hash, &s->package->sections, buf));
+	s->e.name = uci_pkg_strdup(s->package, buf);
+	uci_hash_add(&s->package->section_hash, &s->package->sections, &s->e);
 }
 
 static struct uci_section *
 uci_alloc_section(struct uci_package *p, const char *type, const char *name)
 {
-	struct uci_context *ctx = p->ctx;
 	struct uci_section *s;
 
 	if (name && !name[0])
 		name = NULL;
 
-	s = uci_alloc_element(ctx, section, name, strlen(type) + 1);
+	type = uci_intern(p->ctx, type);
+	s = uci_alloc_pkg_element(p, section, name, 0);
 	uci_list_init(&s->options);
-	s->type = uci_dataptr(s);
+	s->type = (char *) type;
 	s->package = p;
-	strcpy(s->type, type);
 	if (name == NULL)
 		s->anonymous = true;
 	p->n_section++;
 
 	uci_list_add(&p->sections, &s->e.list);
+	uci_hash_add(&p->section_hash, &p->sections, &s->e);
+	uci_type_index_add(p, s);
 
 	return s;
 }
@@ -208,13 +649,15 @@ uci_free_section(struct uci_section *s)
 {
 	struct uci_element *o, *tmp;
 
+	uci_lazy_drop(s);
+	uci_hash_del(s->package->section_hash, &s->e);
+	uci_type_index_del(s->package, s);
+	free(s->option_hash);
+	s->option_hash = NULL;
 	uci_foreach_element_safe(&s->options, tmp, o) {
 		uci_free_option(uci_to_option(o));
 	}
-	if ((s->type != uci_dataptr(s)) &&
-		(s->type != NULL))
-		free(s->type);
-	uci_free_element(&s->e);
+	uci_free_pkg_element(s->package, &s->e);
 }
 
 __plugin struct uci_package *
@@ -227,7 +670,17 @@ uci_alloc_package(struct uci_context *ctx, const char *name)
 	uci_list_init(&p->sections);
 	uci_list_init(&p->delta);
 	uci_list_init(&p->saved_delta);
+	if (ctx->flags & UCI_FLAG_ARENA) {
+		UCI_TRAP_SAVE(ctx, error);
+		p->arena = uci_arena_new(ctx);
+		UCI_TRAP_RESTORE(ctx);
+	}
 	return p;
+
+error:
+	uci_free_element(&p->e);
+	UCI_THROW(ctx, ctx->err);
+	return NULL;
 }
 
 __private void
@@ -239,11 +692,35 @@ uci_free_package(struct uci_package **package)
 	if(!p)
 		return;
 
+	if (p->backend && p->backend->unload)
+		p->backend->unload(p->ctx, p);
 	if (p->path)
 		free(p->path);
-	uci_foreach_element_safe(&p->sections, tmp, e) {
-		uci_free_section(uci_to_section(e));
+	free(p->section_hash);
+	p->section_hash = NULL;
+	uci_type_index_free(p);
+	if (p->view) {
+		/* elements and strings belong to the view */
+		uci_foreach_element(&p->sections, e) {
+			free(uci_to_section(e)->option_hash);
+		}
+		uci_view_free(p->view);
+		p->view = NULL;
+	} else if (p->arena && !p->arena->heap) {
+		/* the element tree lives in the arena, only the lookup
+		 * tables of the sections were allocated separately */
+		uci_foreach_element(&p->sections, e) {
+			free(uci_to_section(e)->option_hash);
+		}
+	} else {
+		uci_foreach_element_safe(&p->sections, tmp, e) {
+			uci_free_section(uci_to_section(e));
+		}
 	}
+	uci_arena_free(p->arena);
+	p->arena = NULL;
+	uci_lazy_free(p->lazy);
+	p->lazy = NULL;
 	uci_foreach_element_safe(&p->delta, tmp, e) {
 		uci_free_delta(uci_to_delta(e));
 	}
@@ -276,24 +753,80 @@ uci_lookup_list(struct uci_list *list, const char *name)
 	struct uci_element *e;
 
 	uci_foreach_element(list, e) {
-		if (!strcmp(e->name, name))
+		if (e->name && !strcmp(e->name, name))
 			return e;
 	}
 	return NULL;
 }
 
-static struct uci_element *
-uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
+/*
+ * look up an element by name, using (and lazily building) a hash table
+ * once the list has grown past UCI_HASH_MIN entries
+ */
+__private struct uci_element *
+uci_lookup_hash(struct uci_hash **hp, struct uci_list *list, const char *name)
 {
-	char *idxstr, *t, *section, *name;
-	struct uci_element *e = NULL;
-	struct uci_section *s;
-	int idx, c;
+	struct uci_element *e, *match = NULL;
+	struct uci_hash *h = *hp;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (!h) {
+		uci_foreach_element(list, e) {
+			if (e->name && !strcmp(e->name, name))
+				return e;
+			count++;
+		}
+		if (count >= UCI_HASH_MIN)
+			*hp = uci_hash_build(list);
+		return NULL;
+	}
 
-	section = uci_strdup(ctx, ptr->section);
-	name = idxstr = section + 1;
+	i = uci_hash_slot(h, name);
+	while ((e = h->slots[i]) != NULL) {
+		if (!strcmp(e->name, name)) {
+			/* duplicate names: the first one in list order wins */
+			if (match)
+				return uci_lookup_list(list, name);
+			match = e;
+		}
+		i = (i + 1) & (h->size - 1);
+	}
+	return match;
+}
 
-	if (section[0] != '@')
+/*
+ * section types are interned by the context that owns the package, other
+ * contexts can only find them in the type index of a frozen package
+ */
+static const char *uci_lookup_type(struct uci_context *ctx, struct uci_package *p, const char *type)
+{
+	struct uci_type_index *ti = p->type_index;
+	int i;
+
+	if (p->ctx == ctx)
+		return uci_intern_lookup(ctx, type);
+
+	for (i = 1; i < ti->n_types; i++) {
+		if (!strcmp(ti->types[i].type, type))
+			return ti->types[i].type;
+	}
+	return NULL;
+}
+
+static struct uci_element *
+uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
+{
+	char *idxstr, *t, *section;
+	const char *name;
+	struct uci_element *e = NULL;
+	struct uci_section *s;
+	int idx, c;
+
+	section = uci_strdup(ctx, ptr->section);
+	name = idxstr = section + 1;
+
+	if (section[0] != '@')
 		goto error;
 
 	/* parse the section index part */
@@ -319,6 +852,26 @@ uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
 		name = NULL;
 	else if (!uci_validate_type(name))
 		goto error;
+	else if (!(name = uci_lookup_type(ctx, ptr->p, name)))
+		goto done;
+
+	if (!ptr->p->type_index)
+		uci_type_index_build(ptr->p);
+
+	if (ptr->p->type_index) {
+		struct uci_type_entry *te;
+
+		e = NULL;
+		te = uci_type_index_find(ptr->p->type_index, name);
+		if (!te)
+			goto done;
+
+		if (idx < 0)
+			idx += te->n;
+		if ((idx >= 0) && (idx < te->n))
+			e = &te->s[idx]->e;
+		goto done;
+	}
 
 	/* if the given index is negative, it specifies the section number from 
 	 * the end of the list */
@@ -326,7 +879,7 @@ uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
 		c = 0;
 		uci_foreach_element(&ptr->p->sections, e) {
 			s = uci_to_section(e);
-			if (name && (strcmp(s->type, name) != 0))
+			if (name && (s->type != name))
 				continue;
 
 			c++;
@@ -337,7 +890,7 @@ uci_lookup_ext_section(struct uci_context *ctx, struct uci_ptr *ptr)
 	c = 0;
 	uci_foreach_element(&ptr->p->sections, e) {
 		s = uci_to_section(e);
-		if (name && (strcmp(s->type, name) != 0))
+		if (name && (s->type != name))
 			continue;
 
 		if (idx == c)
@@ -366,6 +919,8 @@ uci_lookup_next(struct uci_context *ctx, struct uci_element **e, struct uci_list
 	*e = uci_lookup_list(list, name);
 	if (!*e)
 		UCI_THROW(ctx, UCI_ERR_NOTFOUND);
+	if ((*e)->type == UCI_TYPE_SECTION)
+		uci_parse_lazy(ctx, uci_to_section(*e));
 
 	return 0;
 }
@@ -399,8 +954,13 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 		ptr->last = e;
 	}
 
-	if (!ptr->section && !ptr->s)
+	/* only frozen packages may be read through other contexts */
+	UCI_ASSERT(ctx, (ptr->p->ctx == ctx) || ptr->p->frozen);
+
+	if (!ptr->section && !ptr->s) {
+		uci_parse_lazy_package(ctx, ptr->p);
 		goto complete;
+	}
 
 	/* if the section name validates as a regular name, pass through
 	 * to the regular uci_lookup function call */
@@ -412,7 +972,7 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 		else
 			UCI_THROW(ctx, UCI_ERR_INVAL);
 	} else {
-		e = uci_lookup_list(&ptr->p->sections, ptr->section);
+		e = uci_lookup_hash(&ptr->p->section_hash, &ptr->p->sections, ptr->section);
 	}
 
 	if (!e)
@@ -420,9 +980,10 @@ uci_lookup_ptr(struct uci_context *ctx, struct uci_ptr *ptr, char *str, bool ext
 
 	ptr->last = e;
 	ptr->s = uci_to_section(e);
+	uci_parse_lazy(ctx, ptr->s);
 
 	if (ptr->option) {
-		e = uci_lookup_list(&ptr->s->options, ptr->option);
+		e = uci_lookup_hash(&ptr->s->option_hash, &ptr->s->options, ptr->option);
 		if (!e)
 			goto abort;
 
@@ -450,6 +1011,8 @@ uci_expand_ptr(struct uci_context *ctx, struct uci_ptr *ptr, bool complete)
 	if (complete && !(ptr->flags & UCI_LOOKUP_COMPLETE))
 		UCI_THROW(ctx, UCI_ERR_NOTFOUND);
 	UCI_ASSERT(ctx, ptr->p != NULL);
+	if (ptr->s)
+		uci_parse_lazy(ctx, ptr->s);
 
 	/* fill in missing string info */
 	if (ptr->p && !ptr->package)
@@ -478,7 +1041,7 @@ static void uci_add_element_list(struct uci_context *ctx, struct uci_ptr *ptr, b
 	if (!internal && p->has_delta)
 		uci_add_delta(ctx, &p->delta, UCI_CMD_LIST_ADD, ptr->section, ptr->option, ptr->value);
 
-	e = uci_alloc_generic(ctx, UCI_TYPE_ITEM, ptr->value, sizeof(struct uci_option));
+	e = uci_alloc_pkg_generic(p, UCI_TYPE_ITEM, ptr->value, sizeof(struct uci_option));
 	uci_list_add(&ptr->o->v.list, &e->list);
 }
 
@@ -497,17 +1060,31 @@ int uci_rename(struct uci_context *ctx, struct uci_ptr *ptr)
 
 	UCI_ASSERT(ctx, ptr->s);
 	UCI_ASSERT(ctx, ptr->value);
+	UCI_ASSERT_WRITABLE(ctx, p);
 
 	if (!internal && p->has_delta)
 		uci_add_delta(ctx, &p->delta, UCI_CMD_RENAME, ptr->section, ptr->option, ptr->value);
 
-	n = uci_strdup(ctx, ptr->value);
-	if (e->name)
-		free(e->name);
-	e->name = n;
+	if (e->type == UCI_TYPE_SECTION)
+		n = uci_pkg_strdup(p, ptr->value);
+	else
+		n = uci_intern(ctx, ptr->value);
 
 	if (e->type == UCI_TYPE_SECTION)
+		uci_hash_del(p->section_hash, e);
+	else
+		uci_hash_del(ptr->s->option_hash, e);
+
+	if (e->name && (e->type == UCI_TYPE_SECTION))
+		uci_pkg_free(p, e->name);
+	e->name = n;
+
+	if (e->type == UCI_TYPE_SECTION) {
 		uci_to_section(e)->anonymous = false;
+		uci_hash_add(&p->section_hash, &p->sections, e);
+	} else {
+		uci_hash_add(&ptr->s->option_hash, &ptr->s->options, e);
+	}
 
 	return 0;
 }
@@ -515,12 +1092,15 @@ int uci_rename(struct uci_context *ctx, struct uci_ptr *ptr)
 int uci_reorder_section(struct uci_context *ctx, struct uci_section *s, int pos)
 {
 	struct uci_package *p = s->package;
+	bool internal = ctx->internal;
 	char order[32];
 
 	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT_WRITABLE(ctx, p);
 
 	uci_list_set_pos(&s->package->sections, &s->e.list, pos);
-	if (!ctx->internal && p->has_delta) {
+	uci_type_index_update(p, s, NULL);
+	if (!internal && p->has_delta) {
 		sprintf(order, "%d", pos);
 		uci_add_delta(ctx, &p->delta, UCI_CMD_REORDER, s->e.name, NULL, order);
 	}
@@ -535,6 +1115,7 @@ int uci_add_section(struct uci_context *ctx, struct uci_package *p, const char *
 
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT_WRITABLE(ctx, p);
 	s = uci_alloc_section(p, type, NULL);
 	uci_fixup_section(ctx, s);
 	*res = s;
@@ -544,6 +1125,16 @@ int uci_add_section(struct uci_context *ctx, struct uci_package *p, const char *
 	return 0;
 }
 
+static void uci_delete_element(struct uci_ptr *ptr, struct uci_element *e)
+{
+	uci_free_any(&e);
+
+	if (ptr->option)
+		ptr->o = NULL;
+	else if (ptr->section)
+		ptr->s = NULL;
+}
+
 int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr)
 {
 	/* NB: pass on internal flag to uci_del_element */
@@ -557,16 +1148,12 @@ int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr)
 	p = ptr->p;
 
 	UCI_ASSERT(ctx, ptr->s);
+	UCI_ASSERT_WRITABLE(ctx, p);
 
 	if (!internal && p->has_delta)
 		uci_add_delta(ctx, &p->delta, UCI_CMD_REMOVE, ptr->section, ptr->option, NULL);
 
-	uci_free_any(&e);
-
-	if (ptr->option)
-		ptr->o = NULL;
-	else if (ptr->section)
-		ptr->s = NULL;
+	uci_delete_element(ptr, e);
 
 	return 0;
 }
@@ -583,6 +1170,7 @@ int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
 	uci_expand_ptr(ctx, ptr, false);
 	UCI_ASSERT(ctx, ptr->s);
 	UCI_ASSERT(ctx, ptr->value);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
 
 	if (ptr->o) {
 		switch (ptr->o->type) {
@@ -612,73 +1200,608 @@ int uci_add_list(struct uci_context *ctx, struct uci_ptr *ptr)
 	return 0;
 }
 
-int uci_set(struct uci_context *ctx, struct uci_ptr *ptr)
+/*
+ * create or update the element of an expanded pointer with a non-empty
+ * value. returns false if the element already had that value
+ */
+static bool uci_set_element(struct uci_context *ctx, struct uci_ptr *ptr)
 {
-	/* NB: UCI_INTERNAL use means without delta tracking */
-	bool internal = ctx->internal;
-
-	UCI_HANDLE_ERR(ctx);
-	uci_expand_ptr(ctx, ptr, false);
-	UCI_ASSERT(ctx, ptr->value);
-	UCI_ASSERT(ctx, ptr->s || (!ptr->option && ptr->section));
-	if (!ptr->option && ptr->value[0]) {
-		UCI_ASSERT(ctx, uci_validate_type(ptr->value));
-	}
-
 	if (!ptr->o && ptr->s && ptr->option) {
 		struct uci_element *e;
-		e = uci_lookup_list(&ptr->s->options, ptr->option);
+		e = uci_lookup_hash(&ptr->s->option_hash, &ptr->s->options, ptr->option);
 		if (e)
 			ptr->o = uci_to_option(e);
 	}
-	if (!ptr->value[0]) {
-		/* if setting a nonexistant option/section to a nonexistant value,
-		 * exit without errors */
-		if (!(ptr->flags & UCI_LOOKUP_COMPLETE))
-			return 0;
-
-		return uci_delete(ctx, ptr);
-	} else if (!ptr->o && ptr->option) { /* new option */
+	if (!ptr->o && ptr->option) { /* new option */
 		ptr->o = uci_alloc_option(ptr->s, ptr->option, ptr->value);
 		ptr->last = &ptr->o->e;
 	} else if (!ptr->s && ptr->section) { /* new section */
+		/* an @type[idx] reference that matched nothing is not a name */
+		if (ptr->flags & UCI_LOOKUP_EXTENDED)
+			UCI_THROW(ctx, UCI_ERR_NOTFOUND);
 		ptr->s = uci_alloc_section(ptr->p, ptr->value, ptr->section);
 		ptr->last = &ptr->s->e;
 	} else if (ptr->o && ptr->option) { /* update option */
 		if ((ptr->o->type == UCI_TYPE_STRING) &&
 			!strcmp(ptr->o->v.string, ptr->value))
-			return 0;
+			return false;
 		uci_free_option(ptr->o);
 		ptr->o = uci_alloc_option(ptr->s, ptr->option, ptr->value);
 		ptr->last = &ptr->o->e;
 	} else if (ptr->s && ptr->section) { /* update section */
-		char *s = uci_strdup(ctx, ptr->value);
+		char *s = uci_intern(ctx, ptr->value);
+		char *old = ptr->s->type;
 
-		if (ptr->s->type == uci_dataptr(ptr->s)) {
-			ptr->last = NULL;
-			ptr->last = uci_realloc(ctx, ptr->s, sizeof(struct uci_section));
-			ptr->s = uci_to_section(ptr->last);
-			uci_list_fixup(&ptr->s->e.list);
-		} else {
-			free(ptr->s->type);
-		}
+		/* NB: the section must not move, it is referenced by its
+		 * options and by the lookup tables of the package */
 		ptr->s->type = s;
+		ptr->last = &ptr->s->e;
+		uci_type_index_update(ptr->p, ptr->s, old);
 	} else {
 		UCI_THROW(ctx, UCI_ERR_INVAL);
 	}
 
-	if (!internal && ptr->p->has_delta)
+	return true;
+}
+
+int uci_set(struct uci_context *ctx, struct uci_ptr *ptr)
+{
+	/* NB: UCI_INTERNAL use means without delta tracking */
+	bool internal = ctx->internal;
+
+	UCI_HANDLE_ERR(ctx);
+	uci_expand_ptr(ctx, ptr, false);
+	UCI_ASSERT(ctx, ptr->value);
+	UCI_ASSERT(ctx, ptr->s || (!ptr->option && ptr->section));
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
+	if (!ptr->option && ptr->value[0]) {
+		UCI_ASSERT(ctx, uci_validate_type(ptr->value));
+	}
+
+	if (!ptr->value[0]) {
+		/* if setting a nonexistant option/section to a nonexistant value,
+		 * exit without errors */
+		if (!(ptr->flags & UCI_LOOKUP_COMPLETE))
+			return 0;
+
+		/* NB: nested, the trap of the caller must stay in place */
+		UCI_NESTED(uci_delete, ctx, ptr);
+		return 0;
+	}
+
+	if (uci_set_element(ctx, ptr) && !internal && ptr->p->has_delta)
 		uci_add_delta(ctx, &ptr->p->delta, UCI_CMD_CHANGE, ptr->section, ptr->option, ptr->value);
 
 	return 0;
 }
 
+/*
+ * the checks of a batch entry that do not depend on the entries before it.
+ * a run of entries for the same package looks the package up only once
+ */
+static void uci_batch_check(struct uci_context *ctx, struct uci_ptr *ptr, struct uci_ptr *prev)
+{
+	struct uci_element *e;
+
+	if (!ptr->p) {
+		UCI_ASSERT(ctx, ptr->package != NULL);
+		if (prev && !strcmp(ptr->package, prev->p->e.name)) {
+			ptr->p = prev->p;
+		} else if ((e = uci_lookup_list(&ctx->root, ptr->package)) != NULL) {
+			ptr->p = uci_to_package(e);
+		} else {
+			UCI_INTERNAL(uci_load, ctx, ptr->package, &ptr->p);
+			if (!ptr->p)
+				UCI_THROW(ctx, UCI_ERR_NOTFOUND);
+		}
+	}
+
+	UCI_ASSERT(ctx, ptr->s || ptr->section);
+	UCI_ASSERT_WRITABLE(ctx, ptr->p);
+}
+
+/*
+ * expand a batch entry. an entry that names the same section as the one
+ * before it reuses the section that entry found or created
+ */
+static struct uci_element *
+uci_batch_expand(struct uci_context *ctx, struct uci_ptr *ptr, struct uci_ptr *prev, bool complete)
+{
+	if (prev && prev->s && !ptr->s && (ptr->p == prev->p) &&
+		!(ptr->flags & (UCI_LOOKUP_DONE | UCI_LOOKUP_EXTENDED)) &&
+		!(prev->flags & UCI_LOOKUP_EXTENDED) &&
+		!strcmp(ptr->section, prev->section))
+		ptr->s = prev->s;
+
+	return uci_expand_ptr(ctx, ptr, complete);
+}
+
+int uci_set_batch(struct uci_context *ctx, struct uci_ptr *ptrs, size_t n)
+{
+	/* NB: UCI_INTERNAL use means without delta tracking */
+	bool internal = ctx->internal;
+	struct uci_ptr *ptr;
+	size_t i;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, ptrs || !n);
+
+	for (i = 0; i < n; i++) {
+		ptr = &ptrs[i];
+		uci_batch_check(ctx, ptr, i ? &ptrs[i - 1] : NULL);
+		UCI_ASSERT(ctx, ptr->value);
+		if (!ptr->option && ptr->value[0]) {
+			UCI_ASSERT(ctx, uci_validate_type(ptr->value));
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		struct uci_element *e;
+		int cmd = UCI_CMD_CHANGE;
+
+		ptr = &ptrs[i];
+		e = uci_batch_expand(ctx, ptr, i ? &ptrs[i - 1] : NULL, false);
+		UCI_ASSERT(ctx, ptr->s || (!ptr->option && ptr->section));
+
+		if (ptr->value[0]) {
+			if (!uci_set_element(ctx, ptr))
+				continue;
+		} else {
+			/* same as uci_set: an empty value deletes the element */
+			if (!(ptr->flags & UCI_LOOKUP_COMPLETE))
+				continue;
+			cmd = UCI_CMD_REMOVE;
+			uci_delete_element(ptr, e);
+		}
+
+		if (!internal && ptr->p->has_delta)
+			uci_add_delta(ctx, &ptr->p->delta, cmd, ptr->section, ptr->option,
+				(cmd == UCI_CMD_REMOVE) ? NULL : ptr->value);
+	}
+
+	return 0;
+}
+
+int uci_delete_batch(struct uci_context *ctx, struct uci_ptr *ptrs, size_t n)
+{
+	bool internal = ctx->internal;
+	struct uci_ptr *ptr;
+	size_t i;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, ptrs || !n);
+
+	for (i = 0; i < n; i++)
+		uci_batch_check(ctx, &ptrs[i], i ? &ptrs[i - 1] : NULL);
+
+	for (i = 0; i < n; i++) {
+		struct uci_element *e;
+
+		ptr = &ptrs[i];
+		e = uci_batch_expand(ctx, ptr, i ? &ptrs[i - 1] : NULL, true);
+		UCI_ASSERT(ctx, ptr->s);
+
+		if (!internal && ptr->p->has_delta)
+			uci_add_delta(ctx, &ptr->p->delta, UCI_CMD_REMOVE, ptr->section, ptr->option, NULL);
+
+		uci_delete_element(ptr, e);
+	}
+
+	return 0;
+}
+
+/* build the hash table of a list now, if a lookup would build it later */
+static bool uci_hash_prepare(struct uci_hash **hp, struct uci_list *list)
+{
+	struct uci_element *e;
+	unsigned int count = 0;
+
+	if (*hp)
+		return true;
+
+	uci_foreach_element(list, e)
+		count++;
+	if (count < UCI_HASH_MIN)
+		return true;
+
+	*hp = uci_hash_build(list);
+	return !!*hp;
+}
+
+int uci_freeze(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *e;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+	UCI_ASSERT(ctx, p->ctx == ctx);
+
+	if (p->frozen)
+		return 0;
+
+	/* do everything now that lookups would otherwise do on demand */
+	uci_parse_lazy_package(ctx, p);
+	if (!uci_hash_prepare(&p->section_hash, &p->sections))
+		UCI_THROW(ctx, UCI_ERR_MEM);
+	uci_foreach_element(&p->sections, e) {
+		struct uci_section *s = uci_to_section(e);
+
+		if (!uci_hash_prepare(&s->option_hash, &s->options))
+			UCI_THROW(ctx, UCI_ERR_MEM);
+	}
+	if (!p->type_index)
+		uci_type_index_build(p);
+	if (!p->type_index)
+		UCI_THROW(ctx, UCI_ERR_MEM);
+
+	p->readonly = true;
+	p->frozen = true;
+	return 0;
+}
+
 int uci_unload(struct uci_context *ctx, struct uci_package *p)
 {
 	UCI_HANDLE_ERR(ctx);
 	UCI_ASSERT(ctx, p != NULL);
 
 	uci_free_package(&p);
+
+	/* the intern table never shrinks, so drop it once nothing uses it */
+	if (uci_list_empty(&ctx->root)) {
+		uci_intern_free(ctx->intern);
+		ctx->intern = NULL;
+	}
+	return 0;
+}
+
+/*
+ * hand a package that another context loaded over to @ctx. the strings
+ * that the package shares through the intern table of the other context
+ * are replaced first, so the package stays with that context on errors
+ */
+static void uci_adopt_package(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_element *b, *se, *oe;
+
+	UCI_ASSERT(ctx, p->backend != NULL);
+	b = uci_lookup_list(&ctx->backends, p->backend->e.name);
+	if (!b)
+		UCI_THROW(ctx, UCI_ERR_NOTFOUND);
+
+	/* the index compares types by pointer, it is rebuilt on demand */
+	uci_type_index_free(p);
+	uci_foreach_element(&p->sections, se) {
+		struct uci_section *s = uci_to_section(se);
+
+		s->type = uci_intern(ctx, s->type);
+		uci_foreach_element(&s->options, oe) {
+			oe->name = uci_intern(ctx, oe->name);
+		}
+	}
+
+	uci_list_del(&p->e.list);
+	uci_list_add(&ctx->root, &p->e.list);
+	p->ctx = ctx;
+	p->backend = uci_to_backend(b);
+}
+
+/* copy the values of a list option, appending them to the given list */
+static void uci_copy_list(struct uci_package *p, struct uci_list *list, struct uci_option *src)
+{
+	struct uci_element *e, *item;
+
+	uci_foreach_element(&src->v.list, e) {
+		item = uci_alloc_pkg_generic(p, UCI_TYPE_ITEM, e->name, sizeof(struct uci_option));
+		uci_list_add(list, &item->list);
+	}
+}
+
+static bool uci_list_equal(struct uci_list *a, struct uci_list *b)
+{
+	struct uci_list *x, *y;
+
+	for (x = a->next, y = b->next; (x != a) && (y != b); x = x->next, y = y->next) {
+		if (strcmp(list_to_element(x)->name, list_to_element(y)->name) != 0)
+			return false;
+	}
+	return (x == a) && (y == b);
+}
+
+/* give an option the value of its counterpart in a freshly loaded package */
+static void uci_patch_option(struct uci_option *o, struct uci_option *src)
+{
+	struct uci_package *p = o->section->package;
+	struct uci_element *e, *tmp;
+	struct uci_list list;
+	char *str = NULL;
+
+	if (src->type == UCI_TYPE_STRING) {
+		if ((o->type == UCI_TYPE_STRING) && !strcmp(o->v.string, src->v.string))
+			return;
+		str = uci_pkg_strdup(p, src->v.string);
+	} else {
+		if ((o->type == UCI_TYPE_LIST) && uci_list_equal(&o->v.list, &src->v.list))
+			return;
+		uci_list_init(&list);
+		UCI_TRAP_SAVE(p->ctx, error);
+		uci_copy_list(p, &list, src);
+		UCI_TRAP_RESTORE(p->ctx);
+	}
+
+	/* the new value is complete, drop the old one */
+	if (o->type == UCI_TYPE_STRING) {
+		if (o->v.string != uci_dataptr(o))
+			uci_pkg_free(p, o->v.string);
+	} else {
+		uci_foreach_element_safe(&o->v.list, tmp, e) {
+			uci_free_pkg_element(p, e);
+		}
+	}
+
+	o->type = src->type;
+	if (str) {
+		o->v.string = str;
+		return;
+	}
+
+	uci_list_init(&o->v.list);
+	uci_foreach_element_safe(&list, tmp, e) {
+		uci_list_del(&e->list);
+		uci_list_add(&o->v.list, &e->list);
+	}
+	return;
+
+error:
+	uci_foreach_element_safe(&list, tmp, e) {
+		uci_free_pkg_element(p, e);
+	}
+	UCI_THROW(p->ctx, p->ctx->err);
+}
+
+/* update the options of a section in place, keeping the order of src */
+static void uci_patch_section(struct uci_section *s, struct uci_section *src)
+{
+	struct uci_element *e, *tmp;
+	struct uci_option *o, *so;
+
+	uci_foreach_element_safe(&s->options, tmp, e) {
+		if (!uci_lookup_hash(&src->option_hash, &src->options, e->name))
+			uci_free_option(uci_to_option(e));
+	}
+
+	uci_foreach_element(&src->options, e) {
+		so = uci_to_option(e);
+		tmp = uci_lookup_hash(&s->option_hash, &s->options, e->name);
+		if (tmp) {
+			o = uci_to_option(tmp);
+			uci_patch_option(o, so);
+		} else if (so->type == UCI_TYPE_STRING) {
+			o = uci_alloc_option(s, e->name, so->v.string);
+		} else {
+			o = uci_alloc_list(s, e->name);
+			uci_copy_list(s->package, &o->v.list, so);
+		}
+
+		uci_list_del(&o->e.list);
+		uci_list_add(&s->options, &o->e.list);
+	}
+}
+
+static struct uci_section *
+uci_copy_section(struct uci_package *p, struct uci_section *src)
+{
+	struct uci_section *s;
+
+	s = uci_alloc_section(p, src->type, src->e.name);
+	s->anonymous = src->anonymous;
+	uci_patch_section(s, src);
+
+	return s;
+}
+
+/* compare the hash part of two names generated by uci_fixup_section */
+static bool uci_same_hash(const char *a, const char *b)
+{
+	int la = strlen(a), lb = strlen(b);
+
+	return (la > 4) && (lb > 4) && !strcmp(a + la - 4, b + lb - 4);
+}
+
+/*
+ * update a package to the contents of a freshly loaded copy of it.
+ * sections are matched by name first, the remaining anonymous sections
+ * are paired up by type. matched
+ * sections and options are updated in place, so that references to them
+ * held by the application stay valid.
+ */
+static void uci_patch_package(struct uci_package *p, struct uci_package *n)
+{
+	struct uci_context *ctx = p->ctx;
+	struct uci_section **match, *s, *ns;
+	struct uci_element *e, *tmp;
+	struct uci_list keep;
+	int i, round, count = 0;
+	char *name;
+
+	uci_foreach_element(&n->sections, e)
+		count++;
+
+	match = uci_malloc(ctx, (count + 1) * sizeof(*match));
+
+	/* sections are moved around below, the lookup tables are rebuilt
+	 * on demand afterwards */
+	i = 0;
+	uci_foreach_element(&n->sections, e) {
+		tmp = uci_lookup_hash(&p->section_hash, &p->sections, e->name);
+		match[i++] = tmp ? uci_to_section(tmp) : NULL;
+	}
+	free(p->section_hash);
+	p->section_hash = NULL;
+	uci_type_index_free(p);
+
+	/* set aside the sections that are kept */
+	uci_list_init(&keep);
+	for (i = 0; i < count; i++) {
+		if (!match[i])
+			continue;
+		uci_list_del(&match[i]->e.list);
+		uci_list_add(&keep, &match[i]->e.list);
+	}
+
+	/*
+	 * the name of an anonymous section ends in a hash of its contents,
+	 * try to pair up unchanged ones that merely moved first
+	 */
+	for (round = 0; round < 2; round++) {
+		i = 0;
+		uci_foreach_element(&n->sections, e) {
+			ns = uci_to_section(e);
+			if (match[i++] || !ns->anonymous)
+				continue;
+
+			uci_foreach_element(&p->sections, tmp) {
+				s = uci_to_section(tmp);
+				if (!s->anonymous || (s->type != ns->type))
+					continue;
+				if (!round && !uci_same_hash(s->e.name, e->name))
+					continue;
+
+				match[i - 1] = s;
+				uci_list_del(&s->e.list);
+				uci_list_add(&keep, &s->e.list);
+				break;
+			}
+		}
+	}
+
+	/* whatever is left has disappeared from the config */
+	uci_foreach_element_safe(&p->sections, tmp, e) {
+		uci_free_section(uci_to_section(e));
+	}
+
+	UCI_TRAP_SAVE(ctx, error);
+	i = 0;
+	uci_foreach_element(&n->sections, e) {
+		ns = uci_to_section(e);
+		s = match[i++];
+		if (!s) {
+			uci_copy_section(p, ns);
+			continue;
+		}
+
+		uci_list_del(&s->e.list);
+		uci_list_add(&p->sections, &s->e.list);
+		if (strcmp(s->e.name, e->name) != 0) {
+			name = uci_pkg_strdup(p, e->name);
+			uci_pkg_free(p, s->e.name);
+			s->e.name = name;
+		}
+		s->type = ns->type;
+		s->anonymous = ns->anonymous;
+		uci_patch_section(s, ns);
+	}
+	UCI_TRAP_RESTORE(ctx);
+	free(match);
+	return;
+
+error:
+	uci_foreach_element_safe(&keep, tmp, e) {
+		uci_list_del(&e->list);
+		uci_list_add(&p->sections, &e->list);
+	}
+	free(p->section_hash);
+	p->section_hash = NULL;
+	uci_type_index_free(p);
+	free(match);
+	UCI_THROW(ctx, ctx->err);
+}
+
+int uci_reload(struct uci_context *ctx, struct uci_package *p)
+{
+	struct uci_package *n = NULL;
+	/* NB: volatile, the delta replay loop continues after exceptions */
+	struct uci_element *volatile e;
+	struct uci_element *tmp;
+	struct uci_list *prev;
+	struct uci_backend *b;
+	const char *name;
+
+	UCI_HANDLE_ERR(ctx);
+	UCI_ASSERT(ctx, p != NULL);
+
+	b = p->backend;
+	UCI_ASSERT(ctx, b && b->load);
+	if (b->changed && !b->changed(ctx, p))
+		return 0;
+
+	/* the elements of a view cannot be updated in place, and frozen
+	 * packages may be in use by other threads */
+	if (p->view || p->frozen)
+		UCI_THROW(ctx, UCI_ERR_READONLY);
+
+	name = p->e.name;
+	if (p->path && !p->has_delta)
+		name = p->path;
+
+	/* the backend refuses to load a package that is already loaded */
+	prev = p->e.list.prev;
+	uci_list_del(&p->e.list);
+	UCI_TRAP_SAVE(ctx, error);
+	n = b->load(ctx, name);
+	UCI_TRAP_RESTORE(ctx);
+	uci_list_del(&n->e.list);
+	uci_list_insert(prev, &p->e.list);
+
+	UCI_TRAP_SAVE(ctx, done);
+	uci_parse_lazy_package(ctx, p);
+	uci_parse_lazy_package(ctx, n);
+	uci_patch_package(p, n);
+	UCI_TRAP_RESTORE(ctx);
+
+	p->n_section = n->n_section;
+	if (b->unload)
+		b->unload(ctx, p);
+	p->priv = n->priv;
+	n->priv = NULL;
+
+	uci_foreach_element_safe(&p->saved_delta, tmp, e) {
+		uci_free_delta(uci_to_delta(e));
+	}
+	uci_foreach_element_safe(&n->saved_delta, tmp, e) {
+		uci_list_del(&e->list);
+		uci_list_add(&p->saved_delta, &e->list);
+	}
+
+	/* apply the changes that have not been saved yet again, the ones
+	 * that conflict with the new contents are dropped silently */
+	UCI_TRAP_LOOP(ctx, next);
+	uci_foreach_element(&p->delta, e) {
+		struct uci_delta *h = uci_to_delta(e);
+		struct uci_ptr ptr;
+
+		memset(&ptr, 0, sizeof(ptr));
+		ptr.p = p;
+		ptr.package = p->e.name;
+		ptr.section = h->section;
+		ptr.option = h->e.name;
+		ptr.value = h->value;
+
+		uci_replay_delta(ctx, h->cmd, &ptr);
+next:
+		continue;
+	}
+	UCI_TRAP_RESTORE(ctx);
+	ctx->err = 0;
+
+done:
+	uci_free_package(&n);
+	if (ctx->err)
+		UCI_THROW(ctx, ctx->err);
+	return 0;
+
+error:
+	uci_list_insert(prev, &p->e.list);
+	UCI_THROW(ctx, ctx->err);
 	return 0;
 }
 
@@ -260,6 +260,27 @@ uci_lua_load(lua_State *L)
 	return uci_push_status(L, ctx, false);
 }
 
+static int
+uci_lua_reload(lua_State *L)
+{
+	struct uci_context *ctx;
+	struct uci_package *p;
+	const char *s;
+	int offset = 0;
+
+	ctx = find_context(L, &offset);
+	luaL_checkstring(L, 1 + offset);
+	s = lua_tostring(L, 1 + offset);
+	p = find_package(L, ctx, s, true);
+	if (!p) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	uci_reload(ctx, p);
+	return uci_push_status(L, ctx, false);
+}
+
 
 static int
 uci_lua_foreach(lua_State *L)
@@ -863,6 +884,11 @@ uci_lua_cursor(lua_State *L)
 	if (!*u)
 		luaL_error(L, "Cannot allocate UCI context");
 	switch (argc) {
+		case 3:
+			if (lua_isstring(L, 3) &&
+				(uci_set_backend(*u, luaL_checkstring(L, 3)) != UCI_OK))
+				luaL_error(L, "Unable to set backend");
+			/* fall through */
 		case 2:
 			if (lua_isstring(L, 2) &&
 				(uci_set_savedir(*u, luaL_checkstring(L, 2)) != UCI_OK))
@@ -884,6 +910,7 @@ static const luaL_Reg uci[] = {
 	{ "cursor", uci_lua_cursor },
 	{ "load", uci_lua_load },
 	{ "unload", uci_lua_unload },
+	{ "reload", uci_lua_reload },
 	{ "get", uci_lua_get },
 	{ "get_all", uci_lua_get_all },
 	{ "add", uci_lua_add },
@@ -12,27 +12,46 @@
  * GNU Lesser General Public License for more details.
  */
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
 #include "uci.h"
+#include "uci_internal.h"
 
 void uci_parse_section(struct uci_section *s, const struct uci_parse_option *opts,
 		       int n_opts, struct uci_option **tb)
 {
 	struct uci_element *e;
+	bool frozen = s->package->frozen;
+	int i;
 
 	memset(tb, 0, n_opts * sizeof(*tb));
+	if (n_opts <= 0)
+		return;
+
+	/*
+	 * option names are interned, compare them by address. frozen packages
+	 * are read from other threads, while the owning context may change
+	 * its intern table (snapshots have no owner at all), so their names
+	 * are compared by content
+	 */
+	const char *names[n_opts];
+	for (i = 0; i < n_opts; i++) {
+		if (frozen)
+			names[i] = opts[i].name;
+		else
+			names[i] = uci_intern_lookup(s->package->ctx, opts[i].name);
+	}
 
 	uci_foreach_element(&s->options, e) {
 		struct uci_option *o = uci_to_option(e);
-		int i;
 
 		for (i = 0; i < n_opts; i++) {
 			if (tb[i])
 				continue;
 
-			if (strcmp(opts[i].name, o->e.name) != 0)
+			if (frozen ? strcmp(names[i], o->e.name) : (names[i] != o->e.name))
 				continue;
 
 			if (opts[i].type >= 0 && opts[i].type != o->type)
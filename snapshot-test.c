@@ -0,0 +1,97 @@
+/*
+ * snapshot-test - read packages through snapshots and frozen packages
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * usage: snapshot-test <confdir> <package> <section>
+ *
+ * looks up the options "opt" and "list" of the section with
+ * uci_parse_section, once in a snapshot of the package and once in the
+ * frozen package, both through a context that does not own them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "uci.h"
+
+static const struct uci_parse_option opts[] = {
+	{ .name = "opt", .type = UCI_TYPE_STRING },
+	{ .name = "list", .type = UCI_TYPE_LIST },
+};
+
+static int show(struct uci_context *ctx, struct uci_package *p, const char *name, const char *what)
+{
+	struct uci_option *tb[2];
+	struct uci_element *e;
+	struct uci_section *s;
+
+	s = uci_lookup_section(ctx, p, name);
+	if (!s) {
+		fprintf(stderr, "%s: section %s not found\n", what, name);
+		return 1;
+	}
+
+	uci_parse_section(s, opts, 2, tb);
+	printf("%s: opt=%s list=", what, tb[0] ? tb[0]->v.string : "");
+	if (tb[1]) {
+		uci_foreach_element(&tb[1]->v.list, e)
+			printf("%s%s", e->name, e->list.next != &tb[1]->v.list ? "," : "");
+	}
+	printf("\n");
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct uci_context *ctx, *reader;
+	struct uci_snapshot *snap = NULL;
+	struct uci_package *p = NULL;
+	int ret = 1;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s <confdir> <package> <section>\n", argv[0]);
+		return 1;
+	}
+
+	ctx = uci_alloc_context();
+	reader = uci_alloc_context();
+	if (!ctx || !reader)
+		return 1;
+
+	uci_set_confdir(ctx, argv[1]);
+	if ((uci_load(ctx, argv[2], &p) != UCI_OK) ||
+		(uci_snapshot(ctx, p, &snap) != UCI_OK)) {
+		uci_perror(ctx, argv[0]);
+		goto out;
+	}
+
+	/* the snapshot must not depend on the package it was taken from */
+	uci_unload(ctx, p);
+	if (show(reader, uci_snapshot_package(snap), argv[3], "snapshot"))
+		goto out;
+
+	if ((uci_load(ctx, argv[2], &p) != UCI_OK) ||
+		(uci_freeze(ctx, p) != UCI_OK)) {
+		uci_perror(ctx, argv[0]);
+		goto out;
+	}
+	if (show(reader, p, argv[3], "frozen"))
+		goto out;
+
+	ret = 0;
+
+out:
+	uci_snapshot_put(snap);
+	uci_free_context(reader);
+	uci_free_context(ctx);
+	return ret;
+}
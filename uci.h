@@ -50,6 +50,7 @@ enum
 	UCI_ERR_PARSE,
 	UCI_ERR_DUPLICATE,
 	UCI_ERR_UNKNOWN,
+	UCI_ERR_READONLY,
 	UCI_ERR_LAST
 };
 
@@ -70,8 +71,13 @@ struct uci_option;
 struct uci_delta;
 struct uci_context;
 struct uci_backend;
+struct uci_snapshot;
 struct uci_parse_option;
 struct uci_parse_context;
+struct uci_hash;
+struct uci_type_index;
+struct uci_arena;
+struct uci_intern;
 
 
 /**
@@ -129,17 +135,134 @@ extern int uci_export(struct uci_context *ctx, FILE *stream, struct uci_package
  * @ctx: uci context
  * @name: name of the config file (relative to the config directory)
  * @package: store the loaded config package in this variable
+ *
+ * with UCI_FLAG_LAZY, only the section headers of a config file are parsed
+ * by uci_load. the options of a named section are parsed when the section
+ * is first looked up with uci_lookup_ptr or uci_lookup_section, and all of
+ * them when the package itself is looked up with uci_lookup_ptr. until then
+ * the option list of the section is empty, and parse errors in it are only
+ * reported by the lookup.
  */
 extern int uci_load(struct uci_context *ctx, const char *name, struct uci_package **package);
 
+/**
+ * uci_load_many: Load several config packages at once
+ * @ctx: uci context
+ * @names: names of the config files
+ * @n: number of names
+ * @packages: (optional) array of @n entries to store the packages in
+ *
+ * The packages are loaded by a pool of threads, each with a context of its
+ * own that takes the settings of @ctx, and are then added to @ctx in the
+ * order of @names. Packages that are already loaded are not loaded again.
+ * A package that fails to load is left out and its entry in @packages is
+ * set to NULL, the others are still loaded. The error of the first such
+ * package is returned.
+ * The packages are loaded one after another if only one CPU is online and
+ * with UCI_FLAG_PERROR, whose messages must come out in order.
+ */
+extern int uci_load_many(struct uci_context *ctx, char **names, int n, struct uci_package **packages);
+
 /**
  * uci_unload: Unload a config file from the uci context
  *
  * @ctx: uci context
  * @package: pointer to the uci_package struct
+ *
+ * the section types and option names that packages of the context share
+ * are released together once the last package is unloaded
  */
 extern int uci_unload(struct uci_context *ctx, struct uci_package *p);
 
+/**
+ * uci_reload: Update a loaded config package from its backend
+ *
+ * @ctx: uci context
+ * @package: pointer to the uci_package struct
+ *
+ * Does nothing if the backend reports that neither the config file nor
+ * its delta files have changed since the package was loaded. Otherwise
+ * the package is updated in place: sections and options that still exist
+ * keep their uci_section/uci_option structs. Unsaved changes are applied
+ * again on top of the new contents.
+ *
+ * A package that is a mapped read-only view or frozen cannot be updated
+ * in place, UCI_ERR_READONLY is returned if it is out of date.
+ */
+extern int uci_reload(struct uci_context *ctx, struct uci_package *p);
+
+/**
+ * uci_freeze: Make a loaded package safe to read from several threads
+ *
+ * @ctx: uci context
+ * @p: pointer to the uci_package struct
+ *
+ * Does all the work that lookups would otherwise do on demand and makes
+ * the package read-only. Other threads can then read it concurrently
+ * through their own contexts: uci_lookup_section, uci_lookup_option and
+ * uci_parse_section take it directly, and uci_lookup_ptr uses it if it
+ * is set as ptr->p after uci_parse_ptr and @str is NULL.
+ *
+ * A context must only be used by one thread at a time, the package must
+ * stay loaded as long as other threads use it.
+ */
+extern int uci_freeze(struct uci_context *ctx, struct uci_package *p);
+
+/**
+ * uci_snapshot: Take an immutable copy of a loaded package
+ *
+ * @ctx: uci context
+ * @p: pointer to the uci_package struct
+ * @snapshot: store the new snapshot here, with one reference
+ *
+ * The snapshot is laid out in a single buffer and frozen like with
+ * uci_freeze. It does not change when @p is modified, committed or
+ * unloaded, and it does not depend on @ctx, so any number of threads can
+ * read uci_snapshot_package() of it without locks until the last
+ * reference is dropped.
+ */
+extern int uci_snapshot(struct uci_context *ctx, struct uci_package *p, struct uci_snapshot **snapshot);
+
+/**
+ * uci_snapshot_package: Get the package of a snapshot
+ * @s: snapshot
+ *
+ * The package must only be read. It is not part of any context, look it
+ * up like a frozen package (see uci_freeze)
+ */
+extern struct uci_package *uci_snapshot_package(struct uci_snapshot *s);
+
+/**
+ * uci_snapshot_get: Take another reference to a snapshot
+ * @s: snapshot
+ */
+extern struct uci_snapshot *uci_snapshot_get(struct uci_snapshot *s);
+
+/**
+ * uci_snapshot_put: Drop a reference to a snapshot, freeing it with the last one
+ * @s: snapshot (optional)
+ */
+extern void uci_snapshot_put(struct uci_snapshot *s);
+
+/**
+ * uci_snapshot_publish: Replace the current snapshot in a slot
+ * @slot: pointer shared between a writer and its readers, initially NULL
+ * @s: new snapshot, the slot takes over the caller's reference
+ *
+ * Readers that acquired the previous snapshot keep using it until they
+ * drop their reference. Never blocks on file locks or the writer's
+ * context, like uci_snapshot_acquire
+ */
+extern void uci_snapshot_publish(struct uci_snapshot **slot, struct uci_snapshot *s);
+
+/**
+ * uci_snapshot_acquire: Take a reference to the current snapshot in a slot
+ * @slot: pointer that snapshots are published to
+ *
+ * Returns NULL if nothing was published yet
+ */
+extern struct uci_snapshot *uci_snapshot_acquire(struct uci_snapshot **slot);
+
 /**
  * uci_lookup_ptr: Split an uci tuple string and look up an element tree
  * @ctx: uci context
@@ -209,13 +332,69 @@ extern int uci_rename(struct uci_context *ctx, struct uci_ptr *ptr);
  */
 extern int uci_delete(struct uci_context *ctx, struct uci_ptr *ptr);
 
+/**
+ * uci_set_batch: Set the values of several elements
+ * @ctx: uci context
+ * @ptrs: array of uci pointers (with values)
+ * @n: number of pointers in @ptrs
+ *
+ * Every pointer is handled like by uci_set, in array order, so later
+ * entries see the sections created by earlier ones. The pointers need not
+ * have been looked up before; the package and section names of an entry
+ * are resolved once for each run of entries that share them.
+ * All entries are checked for missing values, invalid types and read-only
+ * packages before the first one is applied. If an entry fails later on,
+ * the entries before it remain applied.
+ * Pointers that were looked up before must not refer to elements that an
+ * earlier entry replaces or deletes.
+ */
+extern int uci_set_batch(struct uci_context *ctx, struct uci_ptr *ptrs, size_t n);
+
+/**
+ * uci_delete_batch: Delete several sections or options
+ * @ctx: uci context
+ * @ptrs: array of uci pointers
+ * @n: number of pointers in @ptrs
+ *
+ * Like uci_set_batch, with uci_delete for each entry
+ */
+extern int uci_delete_batch(struct uci_context *ctx, struct uci_ptr *ptrs, size_t n);
+
 /**
  * uci_save: save change delta for a package
  * @ctx: uci context
  * @p: uci_package struct
+ *
+ * changes are appended in the format of the existing delta file. a new
+ * delta file is written in a compact binary format if UCI_FLAG_BINARY_DELTA
+ * is set, and as readable text otherwise. both formats are read back.
  */
 extern int uci_save(struct uci_context *ctx, struct uci_package *p);
 
+/**
+ * uci_apply_delta: apply a change given in the syntax of delta files
+ * @ctx: uci context
+ * @str: the change, e.g. "+network.lan=interface" or "-network.lan.ipaddr"
+ *
+ * the package is loaded if necessary and the change is recorded in its
+ * delta as it was given, so that a single uci_save per package writes
+ * all applied changes. @str is modified while it is parsed
+ */
+extern int uci_apply_delta(struct uci_context *ctx, char *str);
+
+/**
+ * uci_compact_delta: drop superseded changes from the saved delta
+ * @ctx: uci context
+ * @p: uci_package struct
+ *
+ * rewrites the delta file of the package without the changes that are
+ * overridden by later ones, e.g. repeated sets of the same option or
+ * options and anonymous sections that are added and deleted again.
+ * uci_save does this by itself whenever the delta file has grown by a
+ * few kilobytes.
+ */
+extern int uci_compact_delta(struct uci_context *ctx, struct uci_package *p);
+
 /**
  * uci_commit: commit changes to a package
  * @ctx: uci context
@@ -227,6 +406,40 @@ extern int uci_save(struct uci_context *ctx, struct uci_package *p);
  */
 extern int uci_commit(struct uci_context *ctx, struct uci_package **p, bool overwrite);
 
+/**
+ * uci_commit_many: commit changes to several packages together
+ * @ctx: uci context
+ * @p: array of uci_package struct pointers
+ * @n: number of packages
+ * @overwrite: overwrite existing config data and flush delta
+ *
+ * like uci_commit, but all config files stay locked until every package
+ * has been written to a temporary file, and the new files only replace the
+ * old ones once all of them were written successfully. config files that
+ * cannot be replaced that way (e.g. symlinks) make the commit fail instead
+ * of being rewritten in place. the files are renamed one after another, so
+ * an error while they are being replaced can leave the packages before it
+ * committed and the rest unchanged.
+ * all packages need to use the same backend, and each package may only be
+ * given once. the supplied pointers are updated like with uci_commit.
+ * backends that cannot commit several packages together (e.g. those of
+ * plugins) commit them one after another, and an error leaves the
+ * packages before it committed
+ */
+extern int uci_commit_many(struct uci_context *ctx, struct uci_package **p, int n, bool overwrite);
+
+/**
+ * uci_sync: make batched commits durable
+ * @ctx: uci context
+ *
+ * with UCI_FLAG_SYNC_BATCH set, uci_commit only syncs the config file
+ * itself and remembers its directory. this syncs every remembered
+ * directory once, so that a series of commits to the same directory
+ * costs a single directory sync. uci_free_context does the same for
+ * anything still pending.
+ */
+extern int uci_sync(struct uci_context *ctx);
+
 /**
  * uci_list_configs: List available uci config files
  * @ctx: uci context
@@ -280,7 +493,10 @@ extern int uci_parse_argument(struct uci_context *ctx, FILE *stream, char **str,
  * @ctx: uci context
  * @name: name of the backend
  *
- * The default backend is "file", which uses /etc/config for config storage
+ * The default backend is "file", which uses /etc/config for config storage.
+ * The "ucid" backend builds packages from the snapshots published by the
+ * ucid daemon in UCI_RUNDIR instead of parsing the config files, and works
+ * like "file" if the daemon is not running or cannot be reached
  */
 extern int uci_set_backend(struct uci_context *ctx, const char *name);
 
@@ -392,6 +608,14 @@ enum uci_flags {
 	UCI_FLAG_PERROR =        (1 << 1), /* print parser error messages */
 	UCI_FLAG_EXPORT_NAME =   (1 << 2), /* when exporting, name unnamed sections */
 	UCI_FLAG_SAVED_DELTA = (1 << 3), /* store the saved delta in memory as well */
+	UCI_FLAG_ARENA =         (1 << 4), /* allocate package data from large memory chunks */
+	UCI_FLAG_CACHE =         (1 << 5), /* keep compiled copies of parsed config files */
+	UCI_FLAG_READONLY =      (1 << 6), /* load packages read-only, mapped from their compiled copy */
+	UCI_FLAG_ATOMIC_COMMIT = (1 << 7), /* replace config files atomically on commit */
+	UCI_FLAG_SYNC =          (1 << 8), /* make committed config files durable */
+	UCI_FLAG_SYNC_BATCH =    (1 << 9), /* defer syncing the config directory to uci_sync */
+	UCI_FLAG_BINARY_DELTA =  (1 << 10), /* start new change files in the binary format */
+	UCI_FLAG_LAZY =          (1 << 11), /* parse the options of a section on its first lookup */
 };
 
 struct uci_element
@@ -411,6 +635,15 @@ struct uci_backend
 	/* private: */
 	const void *ptr;
 	void *priv;
+
+	/*
+	 * optional hooks of the builtin backends. plugins built against
+	 * older headers end before them, so uci_add_backend never takes them
+	 * from a plugin
+	 */
+	void (*commit_many)(struct uci_context *ctx, struct uci_package **p, int n, bool overwrite);
+	bool (*changed)(struct uci_context *ctx, struct uci_package *p);
+	void (*unload)(struct uci_context *ctx, struct uci_package *p);
 };
 
 struct uci_context
@@ -444,6 +677,10 @@ struct uci_context
 
 	struct uci_list hooks;
 	struct uci_list plugins;
+	struct uci_intern *intern;
+
+	/* directories waiting for uci_sync */
+	struct uci_list sync_dirs;
 };
 
 struct uci_package
@@ -460,6 +697,13 @@ struct uci_package
 	int n_section;
 	struct uci_list delta;
 	struct uci_list saved_delta;
+	struct uci_hash *section_hash;
+	struct uci_type_index *type_index;
+	struct uci_arena *arena;
+	struct uci_view *view;
+	struct uci_lazy *lazy;
+	bool readonly;
+	bool frozen;
 };
 
 struct uci_section
@@ -469,6 +713,12 @@ struct uci_section
 	struct uci_package *package;
 	bool anonymous;
 	char *type;
+
+	/* private: */
+	struct uci_hash *option_hash;
+	char *lazy;		/* option lines that were not parsed yet */
+	int lazy_len;
+	int lazy_line;
 };
 
 struct uci_option
@@ -0,0 +1,4 @@
+#define UCI_PLUGIN_SUPPORT	1
+/* #undef UCI_DEBUG */
+/* #undef UCI_DEBUG_TYPECAST */
+#define UCI_RUNDIR "/var/run/uci"
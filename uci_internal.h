@@ -38,8 +38,118 @@ struct uci_parse_context
 	const char *name;
 	char *buf;
 	int bufsz;
+
+	/* lines read from the stream: buf[0..next) has been handed out to the
+	 * parser, buf[next..len) contains null terminated lines read ahead */
+	int next;
+	int len;
+	bool eol;
+
+	/* input file mapped into memory, lines are parsed in place */
+	char *map;
+	size_t mapsz;
+	char *pos;
+
+	/* lazy import: the section whose option lines are only located */
+	bool lazy;
+	struct uci_section *lazy_section;
 };
 
+/*
+ * open addressing table for looking up elements of a long uci_list
+ * by name, the list itself still defines the element order
+ */
+struct uci_hash
+{
+	unsigned int size;
+	unsigned int used;
+	struct uci_element *slots[];
+};
+
+/*
+ * sections of a package in list order, grouped by type, used for
+ * resolving extended @type[idx] references without a list scan
+ */
+struct uci_type_entry
+{
+	const char *type;
+	unsigned int n;
+	unsigned int size;
+	struct uci_section **s;
+};
+
+struct uci_type_index
+{
+	/* types[0] contains all sections, regardless of their type */
+	unsigned int n_types;
+	unsigned int size;
+	struct uci_type_entry *types;
+};
+
+/*
+ * bump allocator for the element tree of a package (UCI_FLAG_ARENA).
+ * package data is taken from the arena while the package is being
+ * loaded, later changes fall back to the heap.
+ */
+struct uci_arena_chunk;
+struct uci_arena
+{
+	struct uci_arena_chunk *chunks;
+	size_t chunksize;
+	bool open;	/* allocate new package data from the arena */
+	bool heap;	/* some package data lives on the heap */
+};
+
+/*
+ * strings shared by all packages of a context. section types and option
+ * names point into this table, so they can be compared by address and
+ * must never be modified or freed individually.
+ */
+struct uci_intern
+{
+	struct uci_arena *strings;
+	unsigned int size;
+	unsigned int used;
+	char **slots;
+};
+
+/*
+ * a read-only package built straight from a mapped compiled config file.
+ * all elements are taken from one allocation, their strings point into
+ * the mapping.
+ */
+struct uci_view
+{
+	void *map;
+	size_t size;
+	void *elements;
+	bool heap;	/* map was allocated rather than mapped */
+};
+
+/* an immutable copy of a package, see uci_snapshot */
+struct uci_snapshot
+{
+	struct uci_package *package;
+	struct uci_intern *intern;
+	unsigned int refcount;
+};
+
+/*
+ * the mapped config file of a package loaded with UCI_FLAG_LAZY. named
+ * sections point to their option lines in it until they are parsed, the
+ * mapping is dropped once all of them are.
+ */
+struct uci_lazy
+{
+	char *map;
+	size_t size;
+	unsigned int pending;
+};
+
+/* published by the ucid daemon, see cache.c */
+#define UCI_SNAPSHOTDIR		UCI_RUNDIR "/snapshot"
+#define UCI_DAEMON_SOCKET	UCI_RUNDIR "/ucid.sock"
+
 extern const char *uci_confdir;
 extern const char *uci_savedir;
 
@@ -51,22 +161,50 @@ __plugin void uci_add_delta(struct uci_context *ctx, struct uci_list *list, int
 __plugin void uci_free_delta(struct uci_delta *h);
 __plugin struct uci_package *uci_alloc_package(struct uci_context *ctx, const char *name);
 
+__private struct uci_arena *uci_arena_new(struct uci_context *ctx);
+__private void *uci_arena_malloc(struct uci_context *ctx, struct uci_arena *a, size_t size);
+__private char *uci_arena_strdup(struct uci_context *ctx, struct uci_arena *a, const char *str);
+__private bool uci_arena_owns(struct uci_arena *a, const void *ptr);
+__private void uci_arena_free(struct uci_arena *a);
+
+__private char *uci_intern(struct uci_context *ctx, const char *str);
+__private char *uci_intern_lookup(struct uci_context *ctx, const char *str);
+__private void uci_intern_free(struct uci_intern *t);
+
 __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, int pos, bool write, bool create);
 __private void uci_close_stream(FILE *stream);
 __private void uci_getln(struct uci_context *ctx, int offset);
+__private bool uci_input_eof(struct uci_parse_context *pctx);
 
 __private void uci_parse_error(struct uci_context *ctx, char *pos, char *reason);
 __private void uci_alloc_parse_context(struct uci_context *ctx);
 
 __private void uci_cleanup(struct uci_context *ctx);
+__private bool uci_sync_dirs(struct uci_context *ctx);
 __private struct uci_element *uci_lookup_list(struct uci_list *list, const char *name);
+__private struct uci_element *uci_lookup_hash(struct uci_hash **h, struct uci_list *list, const char *name);
+__private void uci_hash_add(struct uci_hash **h, struct uci_list *list, struct uci_element *e);
 __private void uci_fixup_section(struct uci_context *ctx, struct uci_section *s);
 __private void uci_free_package(struct uci_package **package);
 __private struct uci_element *uci_alloc_generic(struct uci_context *ctx, int type, const char *name, int size);
 __private void uci_free_element(struct uci_element *e);
 __private struct uci_element *uci_expand_ptr(struct uci_context *ctx, struct uci_ptr *ptr, bool complete);
 
-__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, bool flush);
+__private struct uci_package *uci_cache_load(struct uci_context *ctx, FILE *stream, const char *name, bool daemon);
+__private void uci_cache_save(struct uci_context *ctx, FILE *stream, struct uci_package *p);
+__private bool uci_cache_publish(FILE *stream, struct uci_package *p, const char *dir, uint32_t serial);
+__private void uci_cache_remove(struct uci_context *ctx, const char *name);
+__private struct uci_package *uci_cache_view(struct uci_context *ctx, FILE *stream, const char *name, bool daemon);
+__private void uci_view_free(struct uci_view *view);
+
+__private void uci_parse_lazy(struct uci_context *ctx, struct uci_section *s);
+__private void uci_parse_lazy_package(struct uci_context *ctx, struct uci_package *p);
+__private void uci_lazy_drop(struct uci_section *s);
+__private void uci_lazy_free(struct uci_lazy *lazy);
+
+__private void uci_replay_delta(struct uci_context *ctx, int cmd, struct uci_ptr *ptr);
+__private int uci_load_delta(struct uci_context *ctx, struct uci_package *p, FILE **flush);
+__private void uci_flush_delta(struct uci_context *ctx, FILE *f);
 
 static inline bool uci_validate_package(const char *str)
 {
@@ -119,8 +257,15 @@ static inline void uci_list_del(struct uci_list *ptr)
 	uci_list_init(ptr);
 }
 
+/* the package has been loaded, further changes go to the heap */
+static inline void uci_seal_package(struct uci_package *p)
+{
+	if (p && p->arena)
+		p->arena->open = false;
+}
 
 extern struct uci_backend uci_file_backend;
+extern struct uci_backend uci_daemon_backend;
 
 #ifdef UCI_PLUGIN_SUPPORT
 /**
@@ -220,6 +365,33 @@ struct uci_backend _var = {		\
 	memcpy(ctx->trap, __old_trap, sizeof(ctx->trap)); \
 } while(0)
 
+/**
+ * UCI_TRAP_LOOP: Catch exceptions in the iterations of a loop
+ *
+ * Sets up a single trap for all iterations, where UCI_TRAP_SAVE inside the
+ * loop would save and restore the trap once per iteration. An exception
+ * jumps to @handler, which must be inside the loop body. The handler either
+ * goes on with the next iteration or passes the error on to the previous
+ * trap with UCI_TRAP_RETHROW.
+ * Local variables that the loop changes must be volatile if they are used
+ * after an exception, and API functions called from the loop must go
+ * through UCI_INTERNAL or UCI_NESTED, or they replace the trap.
+ * Must be closed with UCI_TRAP_RESTORE.
+ */
+#define UCI_TRAP_LOOP(ctx, handler) do {   \
+	jmp_buf	__old_trap;		\
+	int __val;			\
+	memcpy(__old_trap, ctx->trap, sizeof(ctx->trap)); \
+	__val = setjmp(ctx->trap);	\
+	if (__val) {			\
+		ctx->err = __val;	\
+		goto handler;		\
+	}
+#define UCI_TRAP_RETHROW(ctx) do {	\
+	memcpy(ctx->trap, __old_trap, sizeof(ctx->trap)); \
+	UCI_THROW(ctx, ctx->err);	\
+} while (0)
+
 /**
  * UCI_INTERNAL: Do an internal call of a public API function
  * 
@@ -254,4 +426,14 @@ struct uci_backend _var = {		\
 	}				\
 } while (0)
 
+/*
+ * check that the package may be changed.
+ * throw a read-only exception for packages loaded read-only, they must
+ * not be changed, not even internally
+ */
+#define UCI_ASSERT_WRITABLE(ctx, p) do {	\
+	if ((p)->readonly)		\
+		UCI_THROW(ctx, UCI_ERR_READONLY);	\
+} while (0)
+
 #endif
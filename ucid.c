@@ -0,0 +1,372 @@
+/*
+ * ucid - config daemon for the Unified Configuration Interface
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * ucid keeps the packages of the config directory loaded and publishes a
+ * snapshot of each of them in UCI_SNAPSHOTDIR, in the format of the
+ * compiled cache. readers map the snapshots without talking to ucid; a
+ * reader that finds no current snapshot sends the package name followed
+ * by a newline to UCI_DAEMON_SOCKET, and ucid replies with the serial of
+ * the snapshot it published or with a negative error code.
+ */
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+#include "uci.h"
+#include "uci_internal.h"
+
+struct ucid_package {
+	struct ucid_package *next;
+	struct uci_package *p;
+	/* the config file the snapshot was published from */
+	struct stat st;
+	int serial;
+};
+
+static const char *appname;
+static struct uci_context *ctx;
+static struct ucid_package *packages;
+static int serial;
+static volatile sig_atomic_t quit;
+
+static void ucid_usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [<options>]\n\n"
+		"Options:\n"
+		"\t-c <path>  set the search path for config files (default: /etc/config)\n"
+		"\n"
+		"Snapshots and socket are kept in %s\n",
+		appname, UCI_RUNDIR
+	);
+}
+
+static struct ucid_package **ucid_find(const char *name)
+{
+	struct ucid_package **pp;
+
+	for (pp = &packages; *pp; pp = &(*pp)->next) {
+		if (!strcmp((*pp)->p->e.name, name))
+			break;
+	}
+
+	return pp;
+}
+
+/* forget a package whose config file is gone or broken */
+static void ucid_drop(struct ucid_package **pp, const char *name)
+{
+	struct ucid_package *up = *pp;
+	char *filename;
+
+	if (up) {
+		*pp = up->next;
+		if (up->p)
+			uci_unload(ctx, up->p);
+		free(up);
+	}
+
+	if (asprintf(&filename, "%s/%s", UCI_SNAPSHOTDIR, name) >= 0) {
+		unlink(filename);
+		free(filename);
+	}
+}
+
+static bool ucid_current(struct ucid_package *up, struct stat *st)
+{
+	char *filename;
+	bool ret;
+
+	if ((up->st.st_dev != st->st_dev) || (up->st.st_ino != st->st_ino) ||
+		(up->st.st_size != st->st_size) ||
+		(up->st.st_mtim.tv_sec != st->st_mtim.tv_sec) ||
+		(up->st.st_mtim.tv_nsec != st->st_mtim.tv_nsec))
+		return false;
+
+	/* somebody might have cleaned up the snapshot directory */
+	if (asprintf(&filename, "%s/%s", UCI_SNAPSHOTDIR, up->p->e.name) < 0)
+		return false;
+
+	ret = !access(filename, F_OK);
+	free(filename);
+	return ret;
+}
+
+/*
+ * (re)load a package and publish its snapshot, unless the published one is
+ * still current. returns the serial of the snapshot or a negative error
+ */
+static int ucid_publish(const char *name)
+{
+	struct ucid_package **pp, *up;
+	struct uci_package *p = NULL;
+	char *filename;
+	struct stat st;
+	FILE *f;
+	int fd, ret;
+
+	/* only packages of the config directory are served */
+	if (!uci_validate_package(name) || strchr(name, '/') || (name[0] == '.'))
+		return -UCI_ERR_INVAL;
+
+	pp = ucid_find(name);
+	if (asprintf(&filename, "%s/%s", ctx->confdir, name) < 0)
+		return -UCI_ERR_MEM;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	free(filename);
+	if (fd < 0) {
+		ucid_drop(pp, name);
+		return -UCI_ERR_NOTFOUND;
+	}
+
+	/* writers hold an exclusive lock while they modify the file */
+	if ((flock(fd, LOCK_SH) < 0) || (fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -UCI_ERR_IO;
+	}
+
+	up = *pp;
+	if (up && ucid_current(up, &st)) {
+		close(fd);
+		return up->serial;
+	}
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -UCI_ERR_MEM;
+	}
+
+	if (up) {
+		uci_unload(ctx, up->p);
+		up->p = NULL;
+	}
+
+	ret = uci_import(ctx, f, name, &p, true);
+	if (ret == UCI_OK) {
+		if (!up)
+			up = calloc(1, sizeof(*up));
+		if (!up)
+			ret = UCI_ERR_MEM;
+		else if (!uci_cache_publish(f, p, UCI_SNAPSHOTDIR, serial + 1))
+			ret = UCI_ERR_IO;
+	}
+	fclose(f);
+
+	if (ret != UCI_OK) {
+		if (p)
+			uci_unload(ctx, p);
+		if (up && (up != *pp))
+			free(up);
+		ucid_drop(pp, name);
+		return -ret;
+	}
+
+	if (up != *pp) {
+		up->next = packages;
+		packages = up;
+	}
+	up->p = p;
+	up->st = st;
+	up->serial = ++serial;
+
+	return up->serial;
+}
+
+static void ucid_publish_all(void)
+{
+	char **configs = NULL;
+	char **p;
+
+	if ((uci_list_configs(ctx, &configs) != UCI_OK) || !configs)
+		return;
+
+	for (p = configs; *p; p++)
+		ucid_publish(*p);
+
+	free(configs);
+}
+
+static void ucid_request(int listen_fd)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	char buf[256], *nl;
+	ssize_t len, ofs = 0;
+	int fd, ret;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	/* the socket may have been reachable before its mode was set */
+	if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) ||
+		(cred.uid && (cred.uid != geteuid())))
+		goto out;
+
+	/* a stuck client must not block everybody else */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	do {
+		len = recv(fd, buf + ofs, sizeof(buf) - ofs - 1, 0);
+		if (len <= 0)
+			goto out;
+		ofs += len;
+		buf[ofs] = 0;
+		nl = strchr(buf, '\n');
+	} while (!nl && (ofs < sizeof(buf) - 1));
+
+	if (!nl)
+		goto out;
+
+	*nl = 0;
+	ret = ucid_publish(buf);
+	len = snprintf(buf, sizeof(buf), "%d\n", ret);
+	send(fd, buf, len, MSG_NOSIGNAL);
+
+out:
+	close(fd);
+}
+
+/* refresh the snapshots of loaded packages whose config files changed */
+static void ucid_notify(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+
+	len = read(fd, buf, sizeof(buf));
+	for (ptr = buf; len > 0 && ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *) ptr;
+		if (ev->len && *ucid_find(ev->name))
+			ucid_publish(ev->name);
+	}
+}
+
+static int ucid_listen(void)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int fd, ret;
+
+	if ((mkdir(UCI_RUNDIR, 0755) < 0) && (errno != EEXIST))
+		return -1;
+	if ((mkdir(UCI_SNAPSHOTDIR, 0755) < 0) && (errno != EEXIST))
+		return -1;
+
+	strncpy(sun.sun_path, UCI_DAEMON_SOCKET, sizeof(sun.sun_path) - 1);
+	unlink(sun.sun_path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/*
+	 * requests make ucid read and republish config files with its own
+	 * privileges, so only its own user may send them. other users still
+	 * read the snapshots that are already published
+	 */
+	mask = umask(0077);
+	ret = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+	umask(mask);
+	if ((ret < 0) ||
+		(chmod(sun.sun_path, 0600) < 0) ||
+		(listen(fd, 16) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void ucid_signal(int sig)
+{
+	quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[2];
+	int c;
+
+	appname = argv[0];
+	ctx = uci_alloc_context();
+	if (!ctx) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	while ((c = getopt(argc, argv, "c:")) != -1) {
+		switch (c) {
+		case 'c':
+			uci_set_confdir(ctx, optarg);
+			break;
+		default:
+			ucid_usage();
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, ucid_signal);
+	signal(SIGINT, ucid_signal);
+
+	fds[0].fd = ucid_listen();
+	if (fds[0].fd < 0) {
+		perror("ucid");
+		return 1;
+	}
+	fds[0].events = POLLIN;
+
+	fds[1].fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if ((fds[1].fd < 0) ||
+		(inotify_add_watch(fds[1].fd, ctx->confdir,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)) {
+		perror("ucid");
+		return 1;
+	}
+	fds[1].events = POLLIN;
+
+	ucid_publish_all();
+
+	while (!quit) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+		if (fds[1].revents & POLLIN)
+			ucid_notify(fds[1].fd);
+		if (fds[0].revents & POLLIN)
+			ucid_request(fds[0].fd);
+	}
+
+	unlink(UCI_DAEMON_SOCKET);
+	close(fds[0].fd);
+	close(fds[1].fd);
+	uci_free_context(ctx);
+
+	return 0;
+}
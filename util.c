@@ -63,6 +63,91 @@ __plugin char *uci_strdup(struct uci_context *ctx, const char *str)
 	return ptr;
 }
 
+#define UCI_ARENA_ALIGN		sizeof(void *)
+#define UCI_ARENA_CHUNK		4096
+#define UCI_ARENA_CHUNK_MAX	(256 * 1024)
+
+struct uci_arena_chunk
+{
+	struct uci_arena_chunk *next;
+	size_t size;
+	size_t used;
+	void *data[];
+};
+
+__private struct uci_arena *uci_arena_new(struct uci_context *ctx)
+{
+	struct uci_arena *a;
+
+	a = uci_malloc(ctx, sizeof(struct uci_arena));
+	a->chunksize = UCI_ARENA_CHUNK;
+	a->open = true;
+	return a;
+}
+
+/* allocations are zeroed, chunks come from calloc */
+__private void *uci_arena_malloc(struct uci_context *ctx, struct uci_arena *a, size_t size)
+{
+	struct uci_arena_chunk *c = a->chunks;
+	void *ptr;
+
+	size = (size + UCI_ARENA_ALIGN - 1) & ~(UCI_ARENA_ALIGN - 1);
+	if (!c || (c->size - c->used < size)) {
+		size_t csize = a->chunksize;
+
+		while (csize < size)
+			csize *= 2;
+
+		c = calloc(1, sizeof(struct uci_arena_chunk) + csize);
+		if (!c)
+			UCI_THROW(ctx, UCI_ERR_MEM);
+
+		c->size = csize;
+		c->next = a->chunks;
+		a->chunks = c;
+		if (a->chunksize < UCI_ARENA_CHUNK_MAX)
+			a->chunksize *= 2;
+	}
+
+	ptr = (char *) c->data + c->used;
+	c->used += size;
+	return ptr;
+}
+
+__private char *uci_arena_strdup(struct uci_context *ctx, struct uci_arena *a, const char *str)
+{
+	int len = strlen(str) + 1;
+
+	return memcpy(uci_arena_malloc(ctx, a, len), str, len);
+}
+
+__private bool uci_arena_owns(struct uci_arena *a, const void *ptr)
+{
+	struct uci_arena_chunk *c;
+
+	for (c = a->chunks; c; c = c->next) {
+		if (((const char *) ptr >= (const char *) c->data) &&
+			((const char *) ptr < (const char *) c->data + c->size))
+			return true;
+	}
+	return false;
+}
+
+__private void uci_arena_free(struct uci_arena *a)
+{
+	struct uci_arena_chunk *c;
+
+	if (!a)
+		return;
+
+	while (a->chunks) {
+		c = a->chunks;
+		a->chunks = c->next;
+		free(c);
+	}
+	free(a);
+}
+
 /*
  * validate strings for names and types, reject special characters
  * for names, only alphanum and _ is allowed (shell compatibility)
@@ -179,7 +264,7 @@ __private void uci_parse_error(struct uci_context *ctx, char *pos, char *reason)
  */
 __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, int pos, bool write, bool create)
 {
-	struct stat statbuf;
+	struct stat statbuf, pathbuf;
 	FILE *file = NULL;
 	int fd, ret;
 	int mode = (write ? O_RDWR : O_RDONLY);
@@ -192,6 +277,7 @@ __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, i
 		UCI_THROW(ctx, UCI_ERR_NOTFOUND);
 	}
 
+retry:
 	fd = open(filename, mode, UCI_FILEMODE);
 	if (fd < 0)
 		goto error;
@@ -200,6 +286,16 @@ __private FILE *uci_open_stream(struct uci_context *ctx, const char *filename, i
 	if ((ret < 0) && (errno != ENOSYS))
 		goto error;
 
+	/*
+	 * an atomic commit may have renamed a new file into place while we
+	 * were waiting for the lock, in that case lock the new file instead
+	 */
+	if ((fstat(fd, &statbuf) == 0) && (stat(filename, &pathbuf) == 0) &&
+	    ((statbuf.st_dev != pathbuf.st_dev) || (statbuf.st_ino != pathbuf.st_ino))) {
+		close(fd);
+		goto retry;
+	}
+
 	ret = lseek(fd, 0, pos);
 
 	if (ret < 0)